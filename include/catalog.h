@@ -0,0 +1,53 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <Arduino.h>
+#include <stddef.h>
+
+// ===================== CATALOG IMAGE ==================================
+// Product codes and names live in a flat, versioned image in the
+// "catalog" flash partition and are read in place through a memory
+// mapping; only mutable fields (stock, availability) are kept in RAM.
+//
+// The partition holds two slots. A new image is written to the slot not
+// in use and its header is written last, so an interrupted write leaves
+// the previous image valid. An image identical to the one in use is not
+// rewritten at all, so periodic syncs don't wear the flash.
+
+struct CatalogView {
+  const uint8_t *base;       // Mapped slot start (header), nullptr if none
+  int8_t slot;               // Slot index, -1 if none
+  uint16_t count;            // Records in the image
+  uint32_t length;           // Bytes used, header included
+  uint32_t sequence;         // Bumped for each new image
+
+  bool valid() const { return base != nullptr; }
+};
+
+// The newest valid image in flash (at boot), or an invalid view
+CatalogView catalogNewest();
+
+// The image with this sequence number, if either slot still holds it
+bool catalogFind(uint32_t sequence, CatalogView &out);
+
+// Walk records: start with offset = 0. Returns false after the last one.
+// `code` and `name` point into mapped memory and are NUL-terminated.
+bool catalogNext(const CatalogView &view, uint32_t &offset, const char *&code, const char *&name);
+
+// ===================== CATALOG BUILDER ================================
+// One image is built at a time (the sync, under the Sheets client lock).
+// `current` is the image in use; it is never modified.
+
+void catalogBegin(const CatalogView &current);
+
+// Append one record. `outCode`/`outName` point into mapped memory. If the
+// image had to move to the free slot, `relocate` is the offset to add to
+// pointers handed out earlier by this build; otherwise 0.
+bool catalogAppend(const char *code, const char *name,
+                   const char *&outCode, const char *&outName, ptrdiff_t &relocate);
+
+// Finish the build. `out` is the image to use (possibly `current`
+// unchanged); `relocate` as for catalogAppend().
+bool catalogCommit(CatalogView &out, ptrdiff_t &relocate);
+
+#endif // CATALOG_H
@@ -48,11 +48,40 @@ const char spreadsheetId[] = "1fR9fOknNBAp4gqQ_3jFW9tzgvwDybs3g5iWqzlVjvp4";
 // ===================== I2C CONFIGURATION ==============================
 #define I2C_MIN_ADDR 0x08 // for Product Modules
 #define I2C_MAX_ADDR 0x77
+#define I2C_QUEUE_DEPTH         16       // Module requests queued in the I2C engine
+#define I2C_MAX_RETRIES         3        // Attempts per module request
+#define I2C_RETRY_DELAY_MS      100      // Between attempts (until a module has its own)
+#define I2C_RETRY_DELAY_MIN_MS  2        // Floor for a module's adaptive retry delay
+#define I2C_TIMEOUT_MIN_MS      20       // Floor for a module's adaptive reply timeout
+#define I2C_TIMEOUT_MAX_MS      15000    // Ceiling for it (slow dispense motors)
+#define LATENCY_MIN_SAMPLES     8        // Replies per command before a module's timing adapts
+#define LATENCY_TIMEOUT_MARGIN  2        // Adaptive timeout = p99 reply time x this
+#define I2C_SETTLE_MS           10       // Write -> first read
+#define I2C_POLL_MS             10       // Between ACK polls
+#define I2C_DISPENSE_POLL_MS    50       // First ACK poll interval while dispensing
+#define I2C_DISPENSE_POLL_MAX_MS 800     // Dispense polls back off (doubling) to this
+#define I2C_ATTN_PIN            -1       // Shared attention line (open drain, active low); -1 if not wired
+#define I2C_ATTN_FALLBACK_MS    1000     // Poll interval while waiting on the attention line
+#define I2C_SWEEP_INFLIGHT      2        // Background sweep requests queued at once
+#define HEALTH_CYCLE_MS         5000     // Every module polled once per cycle
+#define HEALTH_POLLS_PER_TICK   2        // Polls started per loop() at most
+#define HEALTH_TICK_BUDGET_US   500      // Time checkModuleHealth() may use per loop()
+#define HEALTH_MAX_QUEUED       4        // Skip polling while the I2C queue is this deep
+#define HEALTH_MISS_LIMIT       3        // Missed polls before a module is disconnected
+#define I2C_CLOCK_WINDOW        64       // Transfers per bus error-rate window
+#define I2C_CLOCK_ERROR_LIMIT   4        // Errors in a window that step the clock down
+#define I2C_CLOCK_RECOVER_MS    600000   // After a step-down, try one step up again after this
+#define I2C_HANG_STREAK         3        // Failed transfers in a row (2+ addresses) that trigger bus recovery
+#define I2C_HANG_BACKOFF_MS     1000     // Before retrying a recovery that didn't free the bus
+#define I2C_QUARANTINE_MS       60000    // Isolation of a device that hung the bus (doubles per repeat)
+#define I2C_QUARANTINE_SLOTS    4        // Devices tracked for quarantine
+#define I2C_ADDRESS_MAP_PATH    "/i2caddr.bin"  // LittleFS bitmap of module addresses
 
 // ===================== LCD DISPLAY ====================================
 #define LCD_I2C_ADDR    0x27 
 #define LCD_COLS        20
 #define LCD_ROWS        4
+#define LCD_I2C_MAX_HZ  100000   // PCF8574 backpack rating; many run at 400000
 
 // ===================== KEYPAD CONFIGURATION ===========================
 #define ROWS 4
@@ -68,11 +97,46 @@ extern byte colPins[COLS];
 
 // ===================== TIMING CONSTANTS ==============================
 #define PAYMENT_TIMEOUT_MS      30000    // Confirmation wait timeout
+#define CHECK_AVAIL_MS          500      // "Checking stock..." display time
 #define OOS_TIMEOUT_MS          3000         // Out of stock display time
 #define CANCEL_TIMEOUT_MS       3000      // Cancel message display time
 #define ERROR_TIMEOUT_MS        5000       // Error message display time
 #define SYNC_INTERVAL_MS        30000      // Periodic sync interval
-#define I2C_RESPONSE_TIMEOUT    5000   // I2C response timeout
+#define I2C_RESPONSE_TIMEOUT    5000   // I2C response timeout (until a module has its own)
+
+// ===================== SHEETS WRITE QUEUE ============================
+#define SHEETS_QUEUE_CAPACITY   32       // Max pending outbound Sheets writes
+#define SHEETS_RETRY_MS         5000     // Writer back-off after a failed send
+#define SHEETS_FLUSH_WINDOW_MS  2000     // Collect writes this long before a flush
+#define SHEETS_MAX_ATTEMPTS     5        // Sends before a queued write is dropped
+#define SHEETS_TASK_STACK       10240    // Writer task stack (TLS needs headroom)
+#define SHEETS_TASK_CORE        0        // Arduino loop() runs on core 1
+#define SHEETS_STREAM_CHUNK     1024     // Streaming read buffer; must hold one row
+#define SHEETS_HTTP_TIMEOUT_MS  10000    // Streaming read stall timeout
+#define SHEETS_AUTH_POLL_MS     250      // Sheets task wake rate while awaiting a token
+#define SHEETS_BREAKER_THRESHOLD 3       // Consecutive failures that open the breaker
+#define SHEETS_BACKOFF_BASE_MS  5000     // First open period; doubles per re-open
+#define SHEETS_BACKOFF_MAX_MS   300000   // Open period cap (plus jitter)
+
+// ===================== CATALOG IMAGE =================================
+#define CATALOG_PARTITION_LABEL "catalog"  // Two image slots; see partitions.csv
+#define CATALOG_RAM_SLOT_SIZE   8192     // Per-slot heap fallback without the partition
+
+// ===================== REGISTRY SNAPSHOT =============================
+#define REGISTRY_SNAPSHOT_PATH  "/registry.bin"  // LittleFS file for warm boot
+#define REGISTRY_SNAPSHOT_MAX   16384    // Reject larger images as corrupt
+
+// ===================== TRANSACTION LEDGER ============================
+#define LEDGER_CAPACITY         128      // Transactions kept in RAM (power of two)
+#define LEDGER_STATS_SLOTS      128      // Products with sales counters (power of two)
+#define LEDGER_UPLOAD_BATCH     32       // Transactions per Sheets append
+#define LEDGER_RATE_WINDOW_MS   3600000  // Time constant of the sales-rate estimate
+
+// ===================== CONNECTION MANAGER ============================
+#define WIFI_CONNECT_TIMEOUT_MS 10000    // Association attempt before backing off
+#define WIFI_RETRY_MS           15000    // Back-off before re-issuing WiFi.begin()
+#define NTP_SYNC_TIMEOUT_MS     15000    // Re-request SNTP after this long
+#define BOOT_CONNECT_TIMEOUT_MS 20000    // setup() waits at most this for Sheets
 
 // ===================== I2C PROTOCOL COMMANDS ==========================
 #define CMD_WHOAMI              0x01  // Get module identity
@@ -82,4 +146,33 @@ extern byte colPins[COLS];
 #define CMD_ACK_SUCCESS         0x55  // Success acknowledgment
 #define CMD_ACK_ERROR           0xEE  // Error acknowledgment
 
+// ===================== I2C PROTOCOL V2 ================================
+// Framed, for modules that support it (v2 modules still accept the bare
+// v1 commands above, which is how discovery falls back):
+//   request: START len seq cmd payload... crc
+//   reply:   START len seq ack payload... crc
+// `len` counts seq..payload, `crc` is CRC-8 (poly 0x07, init 0) over
+// len..payload, and the reply echoes the request's seq. A retry resends
+// the same frame, so a module must treat a repeated seq as the same
+// command (never dispense twice). Commands are the v1 codes plus STATUS;
+// `ack` is CMD_ACK_SUCCESS, CMD_ACK_ERROR or CMD_ACK_PENDING.
+#define PROTO_V2_START          0xA5  // First byte of every v2 frame
+#define PROTO_V2_OVERHEAD       5     // START, len, seq, cmd/ack, crc
+#define CMD_STATUS              0x04  // v2: health, stock and identity in one reply
+#define CMD_ACK_PENDING         0xAA  // v2: command accepted, still running
+
+// STATUS reply payload: uidHash u32 (FNV-1a of the UID string), stock
+// u16, faults u8, version u8, caps u8 (all little-endian)
+#define STATUS_PAYLOAD_LEN      9
+#define MODULE_FAULT_MOTOR      0x01  // Motor driver / stall
+#define MODULE_FAULT_JAM        0x02  // Item stuck in the chute
+#define MODULE_FAULT_SENSOR     0x04  // Drop sensor not responding
+#define MODULE_CAP_DISPLAY      0x01  // Has an OLED for UPDATE_DISPLAY
+#define MODULE_CAP_ATTENTION    0x02  // Pulls I2C_ATTN_PIN low when a reply is ready
+#define MODULE_CAP_FAST         0x04  // Runs at 400 kHz (fast mode)
+#define MODULE_CAP_FAST_PLUS    0x08  // Runs at 1 MHz (fast mode plus)
+
+// ACK payload: a PENDING ack may carry retryAfter u16 (ms, 0 = no hint)
+#define ACK_PAYLOAD_LEN         2
+
 #endif // CONFIG_H
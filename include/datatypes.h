@@ -3,6 +3,7 @@
 
 #include <Arduino.h>
 #include <vector>
+#include "catalog.h"
 
 // ===================== ERROR CODES =======================================
 
@@ -16,44 +17,155 @@ enum ErrorCode {
   ERR_SHEETS_SYNC =         6,       // Google Sheets sync failed
   ERR_MODULE_DISCONNECTED = 7,       // Module was connected, now offline
   ERR_INVALID_PRODUCT =     8,       // Product code invalid
-  ERR_APP_TIMEOUT =         9        // Critical operation timeout
+  ERR_APP_TIMEOUT =         9,       // Critical operation timeout
+  ERR_CODE_COUNT =          10       // Number of codes (not an error)
 };
 
 // ===================== PRODUCT DATA STRUCTURES =======================
+// Fixed-layout records with no heap members, held in pools reserved once
+// per registry, so a full refresh allocates nothing.
 
+#define ITEM_CODE_LEN           16       // Max item code chars (buffer adds NUL)
+#define MODULE_UID_LEN          32       // Max module UID chars (WHOAMI reply size)
+#define REGISTRY_MAX_PRODUCTS   256      // Product pool reserved per registry
+#define REGISTRY_MAX_MODULES    32       // Module pool reserved per registry
+
+// ===================== LATENCY HISTOGRAMS ============================
+// Reply times per command class, in power-of-two millisecond buckets:
+// bucket 0 is under 1 ms, bucket b is [2^(b-1), 2^b) ms, and the last
+// bucket takes anything slower. Counts are bytes; when one would
+// overflow, every bucket is halved, so old samples fade out.
+
+#define LATENCY_BUCKETS         14       // Up to 4 s resolved, then "slower"
+
+enum LatencyClass : uint8_t {
+  LAT_POLL = 0,              // STATUS / GET_STOCK
+  LAT_WHOAMI = 1,
+  LAT_DISPLAY = 2,           // UPDATE_DISPLAY, write to ACK
+  LAT_DISPENSE = 3,          // DISPENSE, write to ACK
+  LAT_CLASS_COUNT = 4
+};
+
+struct LatencyHistogram {
+  uint8_t counts[LATENCY_BUCKETS];
+
+  void record(unsigned long ms);
+  uint16_t samples() const;
+  // Upper bound (ms) of the bucket holding the pct-th percentile; 0 if empty
+  uint32_t percentile(uint8_t pct) const;
+};
+
+// Code and name point into the mapped catalog image (see catalog.h)
 struct ProductItem {
-  String itemCode;           // Unique product identifier
-  String name;               // Product name
-  int stock;                 // Current stock count
-  int targetAmount;          // Amount to dispense (usually 1)
-  bool available;            // Is product available for purchase
+  const char *itemCode;      // Unique product identifier
+  const char *name;          // Product name
+  int32_t stock;             // Current stock count
+  uint16_t generation;       // Handle tag, see PRODUCT / MODULE HANDLES
+  uint8_t targetAmount;      // Amount to dispense (usually 1)
+  bool available : 1;        // Is product available for purchase
+  bool dirty : 1;            // Changed by a sync; cleared once modules are told
 };
 
 struct ProductModule {
-  uint8_t i2cAddress;        // I2C address
-  String moduleUID;          // Module's unique identifier (from module itself)
-  String itemCode;           // Associated item code (from Google Sheets)
-  String name;               // Product name
-  int stock;                 // Current stock
-  bool healthy;              // Module health status
-  bool online;               // Currently reachable on I2C bus
+  char moduleUID[MODULE_UID_LEN + 1];   // Module's unique identifier (from module itself)
+  char itemCode[ITEM_CODE_LEN + 1];     // Associated item code (from Google Sheets), "" if none
+  int32_t stock;             // Current stock
   unsigned long lastSeen;    // Last successful communication
+  uint16_t generation;       // Handle tag, see PRODUCT / MODULE HANDLES
+  uint16_t latencyMs;        // Smoothed health-poll reply time, 0 if unknown
+  uint8_t missStreak;        // Consecutive unanswered health polls
+  LatencyHistogram latency[LAT_CLASS_COUNT];   // Sizes this module's timeouts
+  uint8_t i2cAddress;        // I2C address
+  bool healthy : 1;          // Module health status
+  bool online : 1;           // Currently reachable on I2C bus
+  bool dirty : 1;            // Display out of date; cleared by syncModuleDisplays()
+};
+
+// ===================== PRODUCT / MODULE HANDLES ======================
+// A handle names one product or module, not a position in a registry.
+// Each record gets a generation when it is first created; a sync carries
+// it over to the record for the same product code / module UID in the
+// next registry buffer. A handle therefore still resolves after a swap
+// (or returns nullptr if the record is gone), where a raw pointer would
+// be left pointing into the other buffer. `slot` is only a hint.
+
+struct ProductHandle {
+  uint16_t slot;
+  uint16_t generation;       // 0 = no product
+  bool valid() const { return generation != 0; }
+};
+
+struct ModuleHandle {
+  uint16_t slot;
+  uint16_t generation;       // 0 = no module
+  bool valid() const { return generation != 0; }
 };
 
+// Copy `src` into a fixed field of `cap` bytes, truncating; always NUL-terminates
+void copyField(char* dst, size_t cap, const char* src);
+
 // ===================== TRANSACTION & ERROR LOGGING ======================
 
+// One dispense attempt, as kept by the ledger (see ledger.h)
 struct Transaction {
-  String itemCode;
-  int amountDispensed;
-  unsigned long timestamp;
+  uint32_t sequence;                     // Ledger order, from 1
+  char itemCode[ITEM_CODE_LEN + 1];
+  int16_t amountDispensed;
+  unsigned long timestamp;               // millis() when recorded
+  uint32_t epoch;                        // Wall clock (time()), 0 if not set yet
   bool successful;
 };
 
+#define ERROR_LOG_CAPACITY      64       // Ring entries kept (power of two)
+#define ERROR_ITEM_LEN          23       // Affected-item text kept per entry
+
 struct ErrorLog {
-  ErrorCode code;
-  String message;
-  unsigned long timestamp;
-  String affectedItem;
+  uint32_t timestamp;                    // millis() when logged
+  const char *message;                   // String literal (stored by pointer)
+  char affectedItem[ERROR_ITEM_LEN + 1]; // Truncated copy
+  uint8_t code;                          // ErrorCode
+};
+
+// Per-ErrorCode totals since boot; survive the ring wrapping
+struct ErrorStats {
+  uint32_t count;
+  uint32_t firstSeen;                    // millis(), 0 if never
+  uint32_t lastSeen;
+};
+
+// ===================== REGISTRY INDEXES =============================
+
+#define REGISTRY_ADDRESS_SLOTS 128   // Direct table over 7-bit I2C addresses
+
+struct IndexSlot {
+  uint32_t hash;
+  uint16_t index;            // Into the indexed vector; INDEX_EMPTY if free
+};
+
+// Open-addressing hash (linear probing, <= 50% load) from a string key to
+// a vector index. Only hashes are stored; the caller confirms a candidate
+// by comparing its own key, so several entries may share a key.
+class HashIndex {
+public:
+  static const uint16_t INDEX_EMPTY = 0xFFFF;
+
+  HashIndex() : used(0) {}
+
+  static uint32_t hashOf(const char* key);   // FNV-1a
+  void clear();
+  void reserve(size_t entries);
+  void insert(uint32_t hash, uint16_t index);
+  void erase(uint32_t hash, uint16_t index);
+
+  // Candidates for `hash`: start with probe = 0 and call until it
+  // returns -1
+  int next(uint32_t hash, size_t& probe) const;
+
+private:
+  std::vector<IndexSlot> slots;   // Power-of-two size
+  uint16_t used;
+
+  void grow();
 };
 
 // ===================== PRODUCT REGISTRY =============================
@@ -62,38 +174,104 @@ class ProductRegistry {
 private:
   std::vector<ProductItem> products;
   std::vector<ProductModule> modules;
-  std::vector<ErrorLog> errorLogs;
+  CatalogView catalog;                      // Image the product strings point into
+
+  // Lookup indexes, kept in step with every add/update/clear
+  HashIndex productByCode;
+  HashIndex moduleByUID;
+  HashIndex moduleByCode;
+  int16_t moduleByAddress[REGISTRY_ADDRESS_SLOTS];   // -1 if none
+
+  void indexModule(uint16_t i);
+  void unindexModule(uint16_t i);
+  void rebuildIndexes();
   
 public:
-  // Product management
-  void addProduct(const String& code, const String& name, int stock, bool available = true);
-  ProductItem* findProduct(const String& code);
+  ProductRegistry();
+
+  // Product management. Products are added between beginCatalog() and
+  // commitCatalog(); the new catalog image is built against `active`'s.
+  void beginCatalog(const ProductRegistry& active);
+  void addProduct(const char* code, const char* name, int stock, bool available = true);
+  bool commitCatalog();
+  ProductItem* findProduct(const char* code);
+  ProductItem* findProduct(const String& code) { return findProduct(code.c_str()); }
   std::vector<ProductItem>& getProducts() { return products; }
   
   // Module management
-  void addModule(uint8_t addr, const String& uid, const String& code, const String& name, int stock);
+  void addModule(uint8_t addr, const char* uid, const char* code, int stock);
   void updateModuleStock(uint8_t addr, int stock);
   void updateModuleHealth(uint8_t addr, bool online);
-  ProductModule* findModuleByCode(const String& code);
+  ProductModule* findModuleByCode(const char* code);
+  ProductModule* findModuleByCode(const String& code) { return findModuleByCode(code.c_str()); }
   ProductModule* findModuleByAddress(uint8_t addr);
-  ProductModule* findModuleByUID(const String& uid);
+  ProductModule* findModuleByUID(const char* uid);
+  ProductModule* findModuleByUID(const String& uid) { return findModuleByUID(uid.c_str()); }
+  // By HashIndex::hashOf(uid), as reported in a v2 STATUS reply
+  ProductModule* findModuleByUIDHash(uint32_t hash);
   std::vector<ProductModule>& getModules() { return modules; }
+
+  // Handles: take one to keep a record across loop() iterations or a
+  // registry swap, and resolve it again each time it is used
+  ProductHandle handleOf(const ProductItem* p) const;
+  ModuleHandle handleOf(const ProductModule* m) const;
+  ProductItem* resolve(ProductHandle h);
+  ProductModule* resolve(ModuleHandle h);
+
+  // Change a module's indexed fields. Assigning them directly would
+  // leave the lookup indexes stale.
+  void setModuleAddress(ProductModule* m, uint8_t addr);
+  void setModuleUID(ProductModule* m, const char* uid);
+  void setModuleCode(ProductModule* m, const char* code);
+
+  // Display name for a module: its product's name from the catalog, or
+  // "New Module" while unassigned
+  const char* moduleName(const ProductModule& m);
   
-  // Error logging
-  void logError(ErrorCode code, const String& message, const String& affectedItem = "");
-  std::vector<ErrorLog>& getErrorLogs() { return errorLogs; }
+  // Error logging, shared by both registry buffers. Lock-free and
+  // allocation-free: safe from any task. `message` must be a literal.
+  static void logError(ErrorCode code, const char* message, const char* affectedItem = "");
+  static void logError(ErrorCode code, const char* message, uint8_t i2cAddress);
+
+  // Copy up to `max` of the most recent entries, newest first
+  static size_t readErrorLogs(ErrorLog* out, size_t max);
+  static ErrorStats errorStats(ErrorCode code);
   
   // Sync operations
   void clearRegistry();
   bool validateProductExists(const String& code);
 
+  // Carry local-only module state (scan results, health) and handle
+  // generations from the registry being replaced into this freshly
+  // synced one, and mark dirty only the records that differ from it
+  void adoptRuntimeState(const ProductRegistry& previous);
+
+  // Persistence: compact binary image of products and modules in
+  // LittleFS. load() leaves the registry untouched if the image is
+  // missing or corrupt.
+  bool saveSnapshot() const;
+  bool loadSnapshot();
+
   // Debug helpers: print contents to Serial
   void debugPrintProducts();
   void debugPrintModules();
+  static void debugPrintErrors();
 };
 
+// Mount LittleFS on first use (formatting it if needed); false if unusable
+bool mountStorage();
+
 // ===================== GLOBAL REGISTRY ===============================
+// Double-buffered. loop() uses the active registry through g_registry;
+// a background sync fills the back buffer, which is published by an
+// atomic pointer swap at a safe FSM point.
+
+extern ProductRegistry* volatile g_registry;
+
+// The inactive buffer (being built by a sync, or waiting to be published)
+ProductRegistry& backRegistry();
 
-extern ProductRegistry g_registry;
+// Make the back buffer active. Call only from loop() at a safe point.
+void swapRegistries();
 
 #endif // DATATYPES_H
@@ -41,7 +41,7 @@ enum Event {
 extern volatile State currentState;
 extern String inputBuffer;
 extern String selectedCode;
-extern ProductModule* selectedModule;
+extern ModuleHandle selectedModule;
 extern unsigned long stateEnteredAt;
 extern unsigned long confirmDeadline;
 extern unsigned long syncTimer;
@@ -52,6 +52,12 @@ extern String lastErrorMsg;
 void initFSM();
 void enterState(State newState);
 void processEvent(Event evt);
+
+// Queue an event from a completion callback (e.g. the I2C engine); it is
+// processed by the main loop like a key press. takePostedEvent() returns
+// EVT_NONE when there is nothing queued.
+void postEvent(Event evt);
+Event takePostedEvent();
 void onStateEntry(State s);
 void onStateExit(State s);
 void onStateAction(State s);
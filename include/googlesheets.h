@@ -6,31 +6,78 @@
 
 // ===================== DATABASE SYNCHRONIZATION =======================
 
-// Fetch all product data from Google Sheets
+// Fetch all product data from Google Sheets and publish it immediately.
+// Blocking; for a cold boot with no saved snapshot. loop() uses
+// requestSheetsSync(). A complete sync is also saved as the snapshot.
 void syncProductDataFromSheets();
 
-// Update stock count in Google Sheets after dispensing
+// Ask the Sheets task to sync into the back registry buffer. Returns
+// immediately; the result is published by publishSheetsSync(). If
+// Sheets isn't reachable yet the request waits for the connection.
+void requestSheetsSync();
+
+// If a background sync has finished, swap it in as the active registry
+// (keeping module scan/health state and handles) and return true. Call
+// from loop() only. ProductItem* / ProductModule* taken from the old
+// registry are invalid afterwards; keep a handle across calls instead.
+bool publishSheetsSync();
+
+// Queue a stock count update for Google Sheets after dispensing.
+// Returns immediately; repeated updates for one code collapse to the
+// latest value and all pending cells go out in one batchUpdate.
 void updateStockInSheets(const String& itemCode, int newStock);
 
-// Log a transaction to Google Sheets
-void logTransactionToSheets(const String& itemCode, int amount);
+// Record a sale in the transaction ledger and wake the Sheets task,
+// which uploads unsent ledger entries as Transactions rows. Returns
+// immediately; the timestamp is captured now, not when the row is sent.
+void logTransactionToSheets(const char* itemCode, int amount);
 
-// Log error to Google Sheets for remote tracking
+// Queue an error row for Google Sheets (batched with other error rows)
 void logErrorToSheets(const String& errorMsg, const String& errorDetails);
 
-// Register new product module to Google Sheets
+// Queue a new product module row for Google Sheets (batched)
 void registerNewModuleToSheets(const String& moduleUID, uint8_t i2cAddress);
 
 // Check if a module UID is already registered in the Modules sheet.
 // If found, `outAddress` is set to the stored address (0 if missing) and
 // the function returns true. Returns false if not found or on error.
 bool isModuleRegistered(const String& moduleUID, uint8_t &outAddress);
+
+// ===================== OUTBOUND WRITE QUEUE ==========================
+
+// Start the background task that drains queued Sheets writes and runs
+// requested syncs
+void startSheetsTask();
+
+// If a stock update for `itemCode` is still waiting in the queue, set
+// `outStock` to its value and return true. Used by sync so a stale sheet
+// value doesn't overwrite a sale that hasn't been uploaded yet.
+bool pendingStockFor(const String& itemCode, int &outStock);
+
 // ===================== WIFI CONNECTIVITY ============================
 
-// Ensure WiFi connection is active
-void ensureWiFi();
+enum ConnState {
+  CONN_IDLE = 0,             // Nothing started yet
+  CONN_BACKOFF = 1,          // Association failed; waiting before retry
+  CONN_WIFI_WAIT = 2,        // WiFi.begin() issued, waiting for link
+  CONN_NTP_WAIT = 3,         // Link up, waiting for SNTP to set the clock
+  CONN_ONLINE = 4            // Link + clock ok; GSheet token handled by task
+};
+
+// Advance WiFi association / NTP by one non-blocking step. Call every loop().
+void tickConnection();
+
+// Current connection step (for diagnostics)
+ConnState connectionState();
 
 // Get current WiFi connection status
 bool isWiFiConnected();
 
+// True once WiFi is up, the clock is set and the GSheet token is valid.
+// Never blocks.
+bool isSheetsReady();
+
+// Boot only: tick the connection until ready or `timeoutMs` elapses
+bool waitForSheetsReady(unsigned long timeoutMs);
+
 #endif // GOOGLESHEETS_H
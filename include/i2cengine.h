@@ -0,0 +1,129 @@
+#ifndef I2CENGINE_H
+#define I2CENGINE_H
+
+#include <Arduino.h>
+
+// ===================== I2C TRANSACTION ENGINE ========================
+// Queued, non-blocking module transactions. Each request is a small state
+// machine (write, settle, read/poll, retry) advanced by i2cService() from
+// loop(), one bus transfer per call, so nothing waits in delay() and the
+// keypad and LCD stay live. Requests run one at a time in FIFO order.
+// Everything here runs on the loop task, which also owns the LCD's Wire
+// traffic, so the bus needs no lock.
+
+#define I2C_TX_MAX 32              // Bytes written per request
+#define I2C_RX_MAX 32              // Bytes read back per poll
+
+enum I2cStatus : uint8_t {
+  I2C_OK = 0,                // Response accepted
+  I2C_REJECTED = 1,          // Module answered with an error
+  I2C_TIMEOUT = 2,           // No usable answer after every attempt
+  I2C_NACK = 3               // Address not acknowledged on the last attempt
+};
+
+// What a response means to the protocol, decided per read
+enum I2cVerdict : uint8_t {
+  I2C_ACCEPT = 0,            // Done, success
+  I2C_REJECT = 1,            // Done, module reported an error
+  I2C_RETRY = 2,             // Bad/short reply: start the next attempt
+  I2C_KEEP_POLLING = 3       // Not ready yet: read again after pollMs
+};
+
+struct I2cRequest;
+
+// Judges one read; `req` is the request being answered (e.g. to match a
+// sequence number against req.tx). On I2C_KEEP_POLLING the next read
+// comes `pollMs` later; a check may replace it, e.g. with a module's
+// "busy, retry after N ms" hint.
+typedef I2cVerdict (*I2cCheck)(const I2cRequest &req, const uint8_t *rx, uint8_t len,
+                               uint16_t &pollMs);
+
+struct I2cResult {
+  uint8_t addr;
+  I2cStatus status;
+  uint8_t rx[I2C_RX_MAX];    // Last reply read
+  uint8_t rxLen;
+  unsigned long elapsedMs;   // Submit to completion
+  unsigned long responseMs;  // Last attempt: write to final reply (bus latency)
+};
+
+// Runs on the loop task from i2cService(); may submit further requests
+typedef void (*I2cCallback)(const I2cResult &result, void *ctx);
+
+struct I2cRequest {
+  uint8_t addr;
+  uint8_t tx[I2C_TX_MAX];
+  uint8_t txLen;
+  uint8_t rxLen;             // Bytes requested per read
+  uint8_t settleMs;          // Write -> first read
+  uint8_t pollMs;            // Between reads while I2C_KEEP_POLLING
+  uint16_t pollMaxMs;        // If set, the interval doubles per poll up to this
+  bool attention;            // Also read as soon as the attention line falls
+  bool probe;                // Expected to NACK (discovery): not a bus error
+  bool idempotent;           // Safe to resend. If not, a written command is
+                             // never resent: NACKed reads poll on until
+                             // timeoutMs, then it fails with I2C_TIMEOUT
+  uint16_t timeoutMs;        // Per attempt, from the write
+  uint16_t retryDelayMs;     // Failed attempt -> next attempt
+  uint8_t attempts;
+  I2cCheck check;
+  I2cCallback done;          // May be nullptr
+  void *ctx;
+};
+
+// Start the bus at the standard clock and set up the attention line
+// (I2C_ATTN_PIN), if wired. Modules that support it pull the shared line
+// low when a reply is ready, so a request with `attention` set waits for
+// that instead of polling every pollMs. Call once after Wire.begin().
+void i2cBegin();
+
+// True if I2C_ATTN_PIN is wired
+bool i2cHasAttention();
+
+// ===================== BUS CLOCK ====================================
+// The bus runs at the target clock (the fastest every device supports)
+// unless errors have stepped it down: I2C_CLOCK_ERROR_LIMIT failed
+// transfers within I2C_CLOCK_WINDOW drop it one step, and after
+// I2C_CLOCK_RECOVER_MS it tries one step up again.
+
+#define I2C_CLOCK_STANDARD   100000
+#define I2C_CLOCK_FAST       400000
+#define I2C_CLOCK_FAST_PLUS  1000000
+
+void i2cSetClockTarget(uint32_t hz);
+
+// Clock the bus is running at now
+uint32_t i2cClock();
+
+// ===================== BUS RECOVERY =================================
+// A device that glitches mid-transfer can hold SDA low, after which every
+// transfer fails. I2C_HANG_STREAK failed transfers in a row spanning at
+// least two addresses (or a bus error/timeout from the driver) make the
+// engine release the bus: clock SCL until SDA is let go, send a STOP and
+// restart the Wire driver. A streak at a single address is left to the
+// module's own offline handling. If a line really was stuck, the last
+// device seen on the bus before the failures began is quarantined: its
+// requests fail at once, without touching the bus, for
+// I2C_QUARANTINE_MS (doubling on each repeat).
+
+// Clock, recovery count and times, and quarantined addresses on Serial
+void i2cPrintBusHealth();
+
+// Request with the module defaults from config.h; the caller fills in
+// tx/rxLen/check/done
+I2cRequest i2cRequest(uint8_t addr);
+
+// Queue a request. False if the queue is full (nothing is queued).
+bool i2cSubmit(const I2cRequest &req);
+
+// Advance the request at the head of the queue by at most one bus
+// transfer. Call every loop().
+void i2cService();
+
+// Requests queued or in flight
+size_t i2cPending();
+
+// True if a request for `addr` is queued or in flight
+bool i2cBusy(uint8_t addr);
+
+#endif // I2CENGINE_H
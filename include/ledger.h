@@ -0,0 +1,48 @@
+#ifndef LEDGER_H
+#define LEDGER_H
+
+#include <Arduino.h>
+#include "datatypes.h"
+
+// ===================== TRANSACTION LEDGER ============================
+// The last LEDGER_CAPACITY dispense attempts, in RAM, plus per-product
+// sales counters. It is the local sales history (queryable over Serial)
+// and the source the Sheets task uploads Transactions rows from. Safe to
+// use from loop() and the Sheets task.
+
+// Per-product totals since boot
+struct SalesStats {
+  uint32_t sales;            // Successful dispenses
+  uint32_t units;            // Units dispensed
+  uint32_t failures;         // Failed dispense attempts
+  unsigned long lastSale;    // millis() of the latest sale, 0 if none
+  float ratePerHour;         // Decaying sales rate (LEDGER_RATE_WINDOW_MS)
+};
+
+// Record one dispense attempt. Only successful ones are uploaded.
+void ledgerRecord(const char* itemCode, int amount, bool successful);
+
+// Copy up to `max` of the most recent transactions, newest first
+size_t ledgerRecent(Transaction* out, size_t max);
+
+// Totals for `itemCode`; false if it has never been recorded
+bool ledgerStats(const char* itemCode, SalesStats& out);
+
+// ===================== UPLOAD CURSOR ================================
+
+// True if successful sales are waiting to be uploaded
+bool ledgerHasUnsent();
+
+// Copy up to `max` sales not yet uploaded, oldest first. `through` is
+// the sequence to pass to ledgerMarkUploaded() once they are sent.
+// Sales that were overwritten before upload are reported and skipped.
+size_t ledgerUnsent(Transaction* out, size_t max, uint32_t& through);
+
+void ledgerMarkUploaded(uint32_t through);
+
+// ===================== SERIAL REPORTS ================================
+
+void ledgerPrintRecent(size_t max);
+void ledgerPrintSales();
+
+#endif // LEDGER_H
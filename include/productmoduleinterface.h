@@ -5,33 +5,47 @@
 #include <Wire.h>
 #include "config.h"
 #include "datatypes.h"
+#include "i2cengine.h"
 
-// ===================== I2C DISCOVERY & COMMUNICATION ==================
+// ===================== ASYNC MODULE COMMANDS ========================
+// Queue a command on the I2C engine and return at once; false if the
+// queue is full. Completion runs from i2cService() in loop().
 
-// Send WHO_ARE_YOU command to module, get UID and item code
-bool i2c_whoami(uint8_t addr, String &moduleUID);
+// Display push; on failure the module is marked dirty again
+bool i2c_updateDisplayAsync(uint8_t addr, const char* name, int stock);
 
-// Query current stock from module
-bool i2c_getStock(uint8_t addr, int &stock);
+// Stock poll; the reply updates the module's online flag and stock
+bool i2c_getStockAsync(uint8_t addr);
 
-// Update OLED display on module with product info
-bool i2c_updateDisplay(uint8_t addr, const String& name, int stock);
-
-// Send dispense command and wait for acknowledgment
-bool i2c_dispense(uint8_t addr);
+// Dispense. On ACK the sale is booked (stock, ledger, Sheets queue) before
+// `done(true)` is called. False if a dispense is already in flight.
+typedef void (*DispenseCallback)(bool ok);
+bool i2c_dispenseAsync(uint8_t addr, DispenseCallback done);
 
 // ===================== MODULE DISCOVERY & INITIALIZATION ============
 
-// Full I2C bus scan and module discovery
+// Boot: probe the addresses modules were found at last time (blocking,
+// bounded by the installed modules), then start a background sweep of
+// the rest of the bus
 void discoverProductModules();
 
+// Advance the background sweep. Call every loop().
+void tickDiscovery();
+
+// True until the background sweep has covered the whole address range
+bool discoveryRunning();
+
 // Attempt to match discovered modules with Google Sheets data
 void matchModulesToSheets();
 
-// Sync all module displays with current product data
+// Push product data to modules whose display is out of date (dirty)
 void syncModuleDisplays();
 
-// Check module health (online/offline status)
+// Health poller: start at most a couple of stock polls per call, spread
+// so every module is polled once per HEALTH_CYCLE_MS. Replies keep each
+// module's online flag, stock, latencyMs and missStreak current; a module
+// that misses HEALTH_MISS_LIMIT polls in a row is logged as
+// ERR_MODULE_DISCONNECTED. Call every loop().
 void checkModuleHealth();
 
 // Get module by address
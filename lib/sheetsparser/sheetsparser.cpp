@@ -0,0 +1,377 @@
+#include "sheetsparser.h"
+
+// ===================== LEXER HELPERS =================================
+
+static bool isJsonSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static bool isDelimiter(char c) {
+  return isJsonSpace(c) || c == ',' || c == ':' || c == ']' || c == '}';
+}
+
+// `pos` is at an opening quote. On success `pos` is just past the closing
+// quote. Returns false if the string runs past the end of the buffer.
+static bool skipString(const char *buf, size_t len, size_t &pos) {
+  size_t p = pos + 1;
+  while (p < len) {
+    char c = buf[p];
+    if (c == '\\') {
+      p += 2;
+      continue;
+    }
+    if (c == '"') {
+      pos = p + 1;
+      return true;
+    }
+    ++p;
+  }
+  return false;
+}
+
+// Number / true / false / null. A scalar inside a JSON document is always
+// followed by a delimiter, so hitting the end means it is incomplete.
+static bool skipScalar(const char *buf, size_t len, size_t &pos) {
+  size_t p = pos;
+  while (p < len && !isDelimiter(buf[p])) ++p;
+  if (p >= len) return false;
+  pos = p;
+  return true;
+}
+
+static int hexDigit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static long hex4(const char *s) {
+  long v = 0;
+  for (int i = 0; i < 4; ++i) {
+    int d = hexDigit(s[i]);
+    if (d < 0) return -1;
+    v = (v << 4) | d;
+  }
+  return v;
+}
+
+static size_t encodeUtf8(uint32_t cp, char *out) {
+  if (cp < 0x80) {
+    out[0] = (char)cp;
+    return 1;
+  }
+  if (cp < 0x800) {
+    out[0] = (char)(0xC0 | (cp >> 6));
+    out[1] = (char)(0x80 | (cp & 0x3F));
+    return 2;
+  }
+  if (cp < 0x10000) {
+    out[0] = (char)(0xE0 | (cp >> 12));
+    out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[2] = (char)(0x80 | (cp & 0x3F));
+    return 3;
+  }
+  out[0] = (char)(0xF0 | (cp >> 18));
+  out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+  out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+  out[3] = (char)(0x80 | (cp & 0x3F));
+  return 4;
+}
+
+// Decode JSON escapes in `s[0..n)` in place. Every escape is at least as
+// long as its decoded form, so the write cursor never passes the read one.
+static size_t decodeString(char *s, size_t n) {
+  size_t r = 0, w = 0;
+  while (r < n) {
+    char c = s[r++];
+    if (c != '\\' || r >= n) {
+      s[w++] = c;
+      continue;
+    }
+    char e = s[r++];
+    switch (e) {
+      case 'n': s[w++] = '\n'; break;
+      case 't': s[w++] = '\t'; break;
+      case 'r': s[w++] = '\r'; break;
+      case 'b': s[w++] = '\b'; break;
+      case 'f': s[w++] = '\f'; break;
+      case 'u': {
+        long cp = (r + 4 <= n) ? hex4(s + r) : -1;
+        if (cp < 0) {
+          s[w++] = '?';
+          break;
+        }
+        r += 4;
+        // Surrogate pair -> one 4-byte sequence
+        if (cp >= 0xD800 && cp <= 0xDBFF && r + 6 <= n && s[r] == '\\' && s[r + 1] == 'u') {
+          long lo = hex4(s + r + 2);
+          if (lo >= 0xDC00 && lo <= 0xDFFF) {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+            r += 6;
+          }
+        }
+        w += encodeUtf8((uint32_t)cp, s + w);
+        break;
+      }
+      default:
+        // \" \\ \/ decode to the character itself
+        s[w++] = e;
+        break;
+    }
+  }
+  return w;
+}
+
+// ===================== CELL / ROW VIEWS ================================
+
+bool CellView::equals(const char *s) const {
+  size_t n = strlen(s);
+  return n == len && memcmp(ptr, s, n) == 0;
+}
+
+CellView CellView::trimmed() const {
+  CellView v = *this;
+  while (v.len > 0 && isJsonSpace(v.ptr[0])) { ++v.ptr; --v.len; }
+  while (v.len > 0 && isJsonSpace(v.ptr[v.len - 1])) --v.len;
+  return v;
+}
+
+String CellView::toString() const {
+  String s;
+  s.reserve(len);
+  for (uint16_t i = 0; i < len; ++i) s += ptr[i];
+  return s;
+}
+
+size_t CellView::copyTo(char *out, size_t size) const {
+  if (size == 0) return 0;
+  size_t n = len < size - 1 ? len : size - 1;
+  memcpy(out, ptr, n);
+  out[n] = '\0';
+  return n;
+}
+
+long CellView::toLong(long fallback) const {
+  char tmp[24];
+  trimmed().copyTo(tmp, sizeof(tmp));
+  char *endptr = nullptr;
+  long v = strtol(tmp, &endptr, 10);
+  return endptr == tmp ? fallback : v;
+}
+
+bool CellView::toAddress(uint8_t &out) const {
+  char tmp[24];
+  trimmed().copyTo(tmp, sizeof(tmp));
+  // Accept decimal or 0x-prefixed hex, as the sheet allows both
+  char *endptr = nullptr;
+  long v = strtol(tmp, &endptr, 0);
+  if (endptr == tmp) return false;
+  out = (uint8_t)(v & 0xFF);
+  return true;
+}
+
+CellView SheetsRow::cell(uint8_t i) const {
+  if (i < count) return cells[i];
+  CellView none = { "", 0 };
+  return none;
+}
+
+// ===================== VALUES TOKENIZER ===============================
+
+enum ParserKey : uint8_t {
+  KEY_OTHER = 0,
+  KEY_VALUES = 1,            // "values": rows follow
+  KEY_RANGE = 2              // "range": a new value range starts
+};
+
+static uint8_t classifyKey(const char *s, size_t n) {
+  if (n == 6 && memcmp(s, "values", 6) == 0) return KEY_VALUES;
+  if (n == 5 && memcmp(s, "range", 5) == 0) return KEY_RANGE;
+  return KEY_OTHER;
+}
+
+SheetsValuesParser::SheetsValuesParser(SheetsRowCallback onRow, void *ctx)
+  : onRow(onRow), ctx(ctx) {
+  reset();
+}
+
+void SheetsValuesParser::reset() {
+  depth = 0;
+  valuesDepth = -1;
+  lastKey = KEY_OTHER;
+  sawColon = false;
+  ranges = 0;
+  rowIndex = 0;
+  rows = 0;
+  error = false;
+  done = false;
+}
+
+// `pos` is at a row's '['. The row is located first without touching the
+// buffer, so an incomplete row can be re-parsed once more data arrives.
+bool SheetsValuesParser::parseRow(char *buf, size_t len, size_t &pos) {
+  size_t p = pos + 1;
+  int nest = 0;
+  for (;;) {
+    if (p >= len) return false;
+    char c = buf[p];
+    if (c == '"') {
+      if (!skipString(buf, len, p)) return false;
+      continue;
+    }
+    if (c == '[' || c == '{') {
+      ++nest;
+    } else if (c == ']' || c == '}') {
+      if (nest == 0) break;
+      --nest;
+    }
+    ++p;
+  }
+  size_t rowEnd = p;
+
+  SheetsRow row;
+  row.range = ranges > 0 ? ranges - 1 : 0;
+  row.index = rowIndex++;
+  row.count = 0;
+
+  size_t q = pos + 1;
+  while (q < rowEnd) {
+    char c = buf[q];
+    if (isJsonSpace(c) || c == ',') {
+      ++q;
+      continue;
+    }
+
+    CellView cell = { buf + q, 0 };
+    if (c == '"') {
+      size_t end = q;
+      skipString(buf, rowEnd, end);
+      cell.ptr = buf + q + 1;
+      cell.len = (uint16_t)decodeString(buf + q + 1, end - q - 2);
+      q = end;
+    } else if (c == '[' || c == '{') {
+      // Not produced by the values API; skip it as an empty cell
+      int n = 0;
+      do {
+        if (buf[q] == '"') { skipString(buf, rowEnd, q); continue; }
+        if (buf[q] == '[' || buf[q] == '{') ++n;
+        else if (buf[q] == ']' || buf[q] == '}') --n;
+        ++q;
+      } while (n > 0 && q < rowEnd);
+      cell.len = 0;
+    } else {
+      // Unquoted number or boolean: the literal text is the value
+      size_t end = q;
+      skipScalar(buf, rowEnd + 1, end);
+      cell.len = (uint16_t)(end - q);
+      if (cell.equals("null")) cell.len = 0;
+      q = end;
+    }
+
+    if (row.count < SHEETS_MAX_CELLS) row.cells[row.count++] = cell;
+  }
+
+  pos = rowEnd + 1;
+  ++rows;
+  if (onRow) onRow(row, ctx);
+  return true;
+}
+
+size_t SheetsValuesParser::parse(char *buf, size_t len) {
+  size_t pos = 0;
+  size_t consumed = 0;
+
+  while (pos < len && !error) {
+    char c = buf[pos];
+
+    if (valuesDepth >= 0 && depth == valuesDepth && c == '[') {
+      if (!parseRow(buf, len, pos)) return consumed;
+      consumed = pos;
+      continue;
+    }
+
+    switch (c) {
+      case ' ': case '\t': case '\r': case '\n':
+        ++pos;
+        break;
+
+      case ',':
+        lastKey = KEY_OTHER;
+        sawColon = false;
+        ++pos;
+        break;
+
+      case ':':
+        // The API emits "range" before "values" in every value range
+        if (lastKey == KEY_RANGE && ranges < 255) ++ranges;
+        sawColon = (lastKey == KEY_VALUES);
+        lastKey = KEY_OTHER;
+        ++pos;
+        break;
+
+      case '"': {
+        size_t end = pos;
+        if (!skipString(buf, len, end)) return consumed;
+        lastKey = classifyKey(buf + pos + 1, end - pos - 2);
+        sawColon = false;
+        pos = end;
+        break;
+      }
+
+      case '[':
+        ++depth;
+        done = false;
+        // "values": [ ... ] -- rows live one level further in
+        if (sawColon) {
+          valuesDepth = depth;
+          rowIndex = 0;
+        }
+        lastKey = KEY_OTHER;
+        sawColon = false;
+        ++pos;
+        break;
+
+      case '{':
+        ++depth;
+        done = false;
+        lastKey = KEY_OTHER;
+        sawColon = false;
+        ++pos;
+        break;
+
+      case ']':
+        if (valuesDepth >= 0 && depth == valuesDepth) valuesDepth = -1;
+        --depth;
+        done = (depth == 0);
+        ++pos;
+        break;
+
+      case '}':
+        --depth;
+        done = (depth == 0);
+        ++pos;
+        break;
+
+      default: {
+        size_t end = pos;
+        if (!skipScalar(buf, len, end)) return consumed;
+        lastKey = KEY_OTHER;
+        sawColon = false;
+        pos = end;
+        break;
+      }
+    }
+
+    if (depth < 0) error = true;
+    consumed = pos;
+  }
+
+  return consumed;
+}
+
+uint16_t parseSheetValues(char *buf, size_t len, SheetsRowCallback onRow, void *ctx) {
+  SheetsValuesParser parser(onRow, ctx);
+  parser.parse(buf, len);
+  return parser.rowCount();
+}
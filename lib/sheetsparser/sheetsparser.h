@@ -0,0 +1,85 @@
+#ifndef SHEETSPARSER_H
+#define SHEETSPARSER_H
+
+#include <Arduino.h>
+
+// ===================== CELL / ROW VIEWS ================================
+
+#define SHEETS_MAX_CELLS 8       // Cells kept per row; extra columns ignored
+
+// A cell's text as a view into the response buffer (not NUL-terminated).
+// JSON escapes are already decoded in place.
+struct CellView {
+  const char *ptr;
+  uint16_t len;
+
+  bool empty() const { return len == 0; }
+  bool equals(const char *s) const;
+  bool equals(const String &s) const { return equals(s.c_str()); }
+  CellView trimmed() const;
+  String toString() const;
+  long toLong(long fallback = 0) const;   // Decimal, like String::toInt()
+  bool toAddress(uint8_t &out) const;     // Decimal or 0x-prefixed hex; false if not numeric
+  size_t copyTo(char *out, size_t size) const;  // Always NUL-terminates
+};
+
+struct SheetsRow {
+  uint8_t range;             // Which value range in the response (0-based)
+  uint16_t index;            // Row index within that array (sheet row offset)
+  uint8_t count;             // Cells in this row, capped at SHEETS_MAX_CELLS
+  CellView cells[SHEETS_MAX_CELLS];
+
+  // Cell `i`, or an empty view if the row is shorter
+  CellView cell(uint8_t i) const;
+};
+
+typedef void (*SheetsRowCallback)(const SheetsRow &row, void *ctx);
+
+// ===================== VALUES TOKENIZER ===============================
+
+// Single-pass tokenizer for the "values" arrays of a Sheets values
+// response. Walks the caller's buffer in place and hands each completed
+// row to the callback; no heap allocation. Parsing is resumable: parse()
+// stops before an incomplete row or token and returns how many bytes it
+// consumed, so the rest can be presented again with more data appended.
+class SheetsValuesParser {
+public:
+  SheetsValuesParser(SheetsRowCallback onRow, void *ctx);
+
+  void reset();
+
+  // Parse `buf[0..len)`. Decodes escapes in place, so `buf` is modified.
+  size_t parse(char *buf, size_t len);
+
+  bool failed() const { return error; }
+
+  // True once the top-level JSON value has been closed. A stream that
+  // ends before this was cut off, however many rows it delivered.
+  bool complete() const { return done; }
+  uint16_t rowCount() const { return rows; }
+
+  // Value ranges started so far. A batchGet range with no data has no
+  // "values" key, so ranges are counted by their "range" key instead.
+  uint8_t rangesSeen() const { return ranges; }
+
+private:
+  SheetsRowCallback onRow;
+  void *ctx;
+  int depth;                 // Current [ / { nesting
+  int valuesDepth;           // Depth inside the active "values" array, -1 if none
+  uint8_t lastKey;           // Last string if it may be a key we care about
+  bool sawColon;             // ...and it was followed by ':'
+  uint8_t ranges;
+  uint16_t rowIndex;
+  uint16_t rows;
+  bool error;
+  bool done;                 // Top-level value closed (depth back to 0)
+
+  bool parseRow(char *buf, size_t len, size_t &pos);
+};
+
+// Parse a complete response held in `buf` (modified in place).
+// Returns the number of rows emitted.
+uint16_t parseSheetValues(char *buf, size_t len, SheetsRowCallback onRow, void *ctx);
+
+#endif // SHEETSPARSER_H
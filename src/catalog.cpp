@@ -0,0 +1,283 @@
+#include "catalog.h"
+#include "config.h"
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
+#include "rom/crc.h"
+
+// ===================== IMAGE LAYOUT ===================================
+// header:  magic u32, version u16, count u16, sequence u32, length u32,
+//          crc32 u32 (over everything after the header)
+// record:  codeLen u8, nameLen u8, code '\0', name '\0'
+// A slot whose header is still erased (0xFF) holds no image.
+
+struct CatalogHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t count;
+  uint32_t sequence;
+  uint32_t length;
+  uint32_t crc;
+};
+
+static const uint32_t CATALOG_MAGIC = 0x47544143;   // "CATG"
+static const uint16_t CATALOG_VERSION = 1;
+static const uint32_t CATALOG_HEADER = sizeof(CatalogHeader);
+static const uint32_t CATALOG_SECTOR = SPI_FLASH_SEC_SIZE;
+
+// ===================== SLOT STORAGE ===================================
+// Both slots are mapped as one contiguous region. Without a catalog
+// partition the slots fall back to a heap block (lost on reset).
+
+static const esp_partition_t *s_partition = nullptr;
+static spi_flash_mmap_handle_t s_mapHandle;
+static const uint8_t *s_mapped = nullptr;
+static uint8_t *s_ramSlots = nullptr;
+static uint32_t s_slotSize = 0;
+
+static bool mapCatalog() {
+  static bool tried = false;
+  if (tried) return s_mapped != nullptr;
+  tried = true;
+
+  s_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                         CATALOG_PARTITION_LABEL);
+  if (s_partition) {
+    s_slotSize = (s_partition->size / 2) & ~(CATALOG_SECTOR - 1);
+    const void *ptr = nullptr;
+    if (esp_partition_mmap(s_partition, 0, s_slotSize * 2, SPI_FLASH_MMAP_DATA, &ptr, &s_mapHandle) == ESP_OK) {
+      s_mapped = static_cast<const uint8_t*>(ptr);
+      return true;
+    }
+    Serial.println("Catalog: partition mmap failed; using RAM");
+    s_partition = nullptr;
+  } else {
+    Serial.println("Catalog: no '" CATALOG_PARTITION_LABEL "' partition; using RAM");
+  }
+
+  s_slotSize = CATALOG_RAM_SLOT_SIZE;
+  s_ramSlots = static_cast<uint8_t*>(malloc(s_slotSize * 2));
+  if (!s_ramSlots) return false;
+  memset(s_ramSlots, 0xFF, s_slotSize * 2);
+  s_mapped = s_ramSlots;
+  return true;
+}
+
+static const uint8_t *slotBase(int8_t slot) {
+  return s_mapped + (uint32_t)slot * s_slotSize;
+}
+
+static bool slotErase(int8_t slot, uint32_t offset) {
+  if (s_ramSlots) {
+    memset(s_ramSlots + (uint32_t)slot * s_slotSize + offset, 0xFF, CATALOG_SECTOR);
+    return true;
+  }
+  return esp_partition_erase_range(s_partition, (uint32_t)slot * s_slotSize + offset, CATALOG_SECTOR) == ESP_OK;
+}
+
+// `data` must not point into mapped flash (the cache is off during writes)
+static bool slotWrite(int8_t slot, uint32_t offset, const void *data, size_t len) {
+  if (s_ramSlots) {
+    memcpy(s_ramSlots + (uint32_t)slot * s_slotSize + offset, data, len);
+    return true;
+  }
+  // IDF invalidates the cached mapping of written regions, so the image
+  // reads back through s_mapped straight away
+  return esp_partition_write(s_partition, (uint32_t)slot * s_slotSize + offset, data, len) == ESP_OK;
+}
+
+static bool readHeader(int8_t slot, CatalogView &out) {
+  CatalogHeader h;
+  memcpy(&h, slotBase(slot), sizeof(h));
+  if (h.magic != CATALOG_MAGIC || h.version != CATALOG_VERSION) return false;
+  if (h.length < CATALOG_HEADER || h.length > s_slotSize) return false;
+  if (crc32_le(0, slotBase(slot) + CATALOG_HEADER, h.length - CATALOG_HEADER) != h.crc) return false;
+
+  out.base = slotBase(slot);
+  out.slot = slot;
+  out.count = h.count;
+  out.length = h.length;
+  out.sequence = h.sequence;
+  return true;
+}
+
+static CatalogView noCatalog() {
+  CatalogView v = { nullptr, -1, 0, 0, 0 };
+  return v;
+}
+
+// ===================== READ ACCESS ====================================
+
+CatalogView catalogNewest() {
+  CatalogView best = noCatalog();
+  if (!mapCatalog()) return best;
+  for (int8_t slot = 0; slot < 2; ++slot) {
+    CatalogView v;
+    if (readHeader(slot, v) && (!best.valid() || v.sequence > best.sequence)) best = v;
+  }
+  return best;
+}
+
+bool catalogFind(uint32_t sequence, CatalogView &out) {
+  if (!mapCatalog()) return false;
+  for (int8_t slot = 0; slot < 2; ++slot) {
+    if (readHeader(slot, out) && out.sequence == sequence) return true;
+  }
+  return false;
+}
+
+bool catalogNext(const CatalogView &view, uint32_t &offset, const char *&code, const char *&name) {
+  if (!view.valid()) return false;
+  if (offset < CATALOG_HEADER) offset = CATALOG_HEADER;
+  if (offset + 4 > view.length) return false;
+
+  const uint8_t *rec = view.base + offset;
+  uint32_t size = 4 + rec[0] + rec[1];
+  if (offset + size > view.length) return false;
+  code = reinterpret_cast<const char*>(rec + 2);
+  name = code + rec[0] + 1;
+  offset += size;
+  return true;
+}
+
+// ===================== BUILDER ========================================
+
+struct CatalogBuild {
+  CatalogView current;       // Image in use; read-only
+  int8_t slot;               // Slot being written once the image diverges
+  uint32_t offset;           // Next record offset
+  uint16_t count;
+  uint32_t erasedTo;         // Bytes of `slot` erased so far
+  uint32_t sequence;         // For the new image, if one is written
+  bool diverged;             // Records no longer match `current`
+  bool failed;
+};
+
+static CatalogBuild s_build;
+
+// Write at `offset` in the build slot, erasing sectors just ahead of use
+static bool buildWrite(uint32_t offset, const void *data, size_t len) {
+  while (s_build.erasedTo < offset + len) {
+    if (!slotErase(s_build.slot, s_build.erasedTo)) return false;
+    s_build.erasedTo += CATALOG_SECTOR;
+  }
+  return slotWrite(s_build.slot, offset, data, len);
+}
+
+// The new image differs from the one in use: continue in the free slot,
+// starting with a copy of the records that matched so far
+static bool divergeBuild(ptrdiff_t &relocate) {
+  s_build.diverged = true;
+  const CatalogView &cur = s_build.current;
+  uint8_t chunk[64];
+  for (uint32_t off = CATALOG_HEADER; off < s_build.offset; off += sizeof(chunk)) {
+    size_t n = s_build.offset - off < sizeof(chunk) ? s_build.offset - off : sizeof(chunk);
+    memcpy(chunk, cur.base + off, n);
+    if (!buildWrite(off, chunk, n)) return false;
+  }
+  // Make sure the header sector is erased even if nothing was copied
+  if (s_build.erasedTo == 0) {
+    if (!slotErase(s_build.slot, 0)) return false;
+    s_build.erasedTo = CATALOG_SECTOR;
+  }
+  if (s_build.offset > CATALOG_HEADER) relocate = slotBase(s_build.slot) - cur.base;
+  return true;
+}
+
+static bool buildFailed(const char *reason) {
+  Serial.print("Catalog build failed: ");
+  Serial.println(reason);
+  s_build.failed = true;
+  return false;
+}
+
+void catalogBegin(const CatalogView &current) {
+  s_build.current = current;
+  s_build.slot = (current.valid() && current.slot == 0) ? 1 : 0;
+  s_build.offset = CATALOG_HEADER;
+  s_build.count = 0;
+  s_build.erasedTo = 0;
+  s_build.sequence = 1;
+  s_build.diverged = false;
+  s_build.failed = !mapCatalog();
+
+  for (int8_t slot = 0; slot < 2 && !s_build.failed; ++slot) {
+    CatalogView v;
+    if (readHeader(slot, v) && v.sequence >= s_build.sequence) s_build.sequence = v.sequence + 1;
+  }
+}
+
+bool catalogAppend(const char *code, const char *name,
+                   const char *&outCode, const char *&outName, ptrdiff_t &relocate) {
+  relocate = 0;
+  if (s_build.failed) return false;
+
+  size_t codeSize = strlen(code);
+  size_t nameSize = strlen(name);
+  uint8_t codeLen = codeSize < 255 ? codeSize : 255;
+  uint8_t nameLen = nameSize < 255 ? nameSize : 255;
+  uint8_t rec[4 + 255 + 255];
+  rec[0] = codeLen;
+  rec[1] = nameLen;
+  memcpy(rec + 2, code, codeLen);
+  rec[2 + codeLen] = '\0';
+  memcpy(rec + 3 + codeLen, name, nameLen);
+  rec[3 + codeLen + nameLen] = '\0';
+  uint32_t size = 4 + codeLen + nameLen;
+
+  const CatalogView &cur = s_build.current;
+  const uint8_t *at;
+  if (!s_build.diverged && cur.valid() && s_build.offset + size <= cur.length &&
+      memcmp(cur.base + s_build.offset, rec, size) == 0) {
+    // Same record as the image in use: nothing to write
+    at = cur.base + s_build.offset;
+  } else {
+    if (!s_build.diverged && !divergeBuild(relocate)) return buildFailed("flash erase/write");
+    if (s_build.offset + size > s_slotSize) return buildFailed("catalog slot full");
+    if (!buildWrite(s_build.offset, rec, size)) return buildFailed("flash write");
+    at = slotBase(s_build.slot) + s_build.offset;
+  }
+
+  outCode = reinterpret_cast<const char*>(at + 2);
+  outName = outCode + codeLen + 1;
+  s_build.offset += size;
+  ++s_build.count;
+  return true;
+}
+
+bool catalogCommit(CatalogView &out, ptrdiff_t &relocate) {
+  relocate = 0;
+  if (s_build.failed) return false;
+
+  const CatalogView &cur = s_build.current;
+  if (!s_build.diverged && cur.valid() && s_build.offset == cur.length && s_build.count == cur.count) {
+    out = cur;
+    return true;
+  }
+  // Fewer records than the image in use still means a new image
+  if (!s_build.diverged && !divergeBuild(relocate)) return buildFailed("flash erase/write");
+
+  CatalogHeader h;
+  h.magic = CATALOG_MAGIC;
+  h.version = CATALOG_VERSION;
+  h.count = s_build.count;
+  h.sequence = s_build.sequence;
+  h.length = s_build.offset;
+  h.crc = crc32_le(0, slotBase(s_build.slot) + CATALOG_HEADER, s_build.offset - CATALOG_HEADER);
+  // Header last: until it lands the slot reads as empty
+  if (!slotWrite(s_build.slot, 0, &h, sizeof(h))) return buildFailed("header write");
+
+  out.base = slotBase(s_build.slot);
+  out.slot = s_build.slot;
+  out.count = h.count;
+  out.length = h.length;
+  out.sequence = h.sequence;
+
+  Serial.print("Catalog image ");
+  Serial.print(h.sequence);
+  Serial.print(" written: ");
+  Serial.print(h.count);
+  Serial.print(" products, ");
+  Serial.print(h.length);
+  Serial.println(" bytes");
+  return true;
+}
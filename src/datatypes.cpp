@@ -1,122 +1,516 @@
 #include "datatypes.h"
+#include "config.h"
+#include <LittleFS.h>
+#include "rom/crc.h"
+#include <atomic>
 
-// Global product registry instance
-ProductRegistry g_registry;
+// Registry buffers; g_registry points at the active one
+static ProductRegistry s_registries[2];
+ProductRegistry* volatile g_registry = &s_registries[0];
 
-// ===================== PRODUCT MANAGEMENT =============================
+// Handle generations; records are created on both the loop and Sheets task
+static std::atomic<uint16_t> s_nextGeneration(1);
 
-void ProductRegistry::addProduct(const String& code, const String& name, int stock, bool available) {
-  // Avoid duplicates
-  for (auto& p : products) {
-    if (p.itemCode == code) {
-      p.name = name;
-      p.stock = stock;
-      p.available = available;
-      return;
+static uint16_t newGeneration() {
+  uint16_t g = s_nextGeneration.fetch_add(1, std::memory_order_relaxed);
+  // 0 means "no record"; skip it when the counter wraps
+  return g ? g : s_nextGeneration.fetch_add(1, std::memory_order_relaxed);
+}
+
+// ===================== REGISTRY INDEXES =============================
+
+uint32_t HashIndex::hashOf(const char* key) {
+  uint32_t h = 2166136261u;
+  while (*key) {
+    h ^= (uint8_t)*key++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+void HashIndex::reserve(size_t entries) {
+  size_t want = 16;
+  while (want < entries * 2) want *= 2;
+  if (slots.size() >= want) return;
+  IndexSlot empty = { 0, INDEX_EMPTY };
+  std::vector<IndexSlot> old;
+  old.swap(slots);
+  slots.assign(want, empty);
+  used = 0;
+  for (auto& s : old) {
+    if (s.index != INDEX_EMPTY) insert(s.hash, s.index);
+  }
+}
+
+void HashIndex::clear() {
+  for (auto& s : slots) s.index = INDEX_EMPTY;
+  used = 0;
+}
+
+void HashIndex::grow() {
+  std::vector<IndexSlot> old;
+  old.swap(slots);
+  IndexSlot empty = { 0, INDEX_EMPTY };
+  slots.assign(old.empty() ? 16 : old.size() * 2, empty);
+  used = 0;
+  for (auto& s : old) {
+    if (s.index != INDEX_EMPTY) insert(s.hash, s.index);
+  }
+}
+
+void HashIndex::insert(uint32_t hash, uint16_t index) {
+  if ((size_t)(used + 1) * 2 > slots.size()) grow();
+  size_t mask = slots.size() - 1;
+  size_t pos = hash & mask;
+  while (slots[pos].index != INDEX_EMPTY) pos = (pos + 1) & mask;
+  slots[pos].hash = hash;
+  slots[pos].index = index;
+  ++used;
+}
+
+void HashIndex::erase(uint32_t hash, uint16_t index) {
+  if (slots.empty()) return;
+  size_t mask = slots.size() - 1;
+  size_t pos = hash & mask;
+  while (slots[pos].index != INDEX_EMPTY && !(slots[pos].hash == hash && slots[pos].index == index)) {
+    pos = (pos + 1) & mask;
+  }
+  if (slots[pos].index == INDEX_EMPTY) return;
+
+  // Backward-shift deletion: pull later entries of the probe run into the
+  // hole unless their home slot lies after it
+  for (;;) {
+    slots[pos].index = INDEX_EMPTY;
+    size_t next = pos;
+    for (;;) {
+      next = (next + 1) & mask;
+      if (slots[next].index == INDEX_EMPTY) {
+        --used;
+        return;
+      }
+      size_t home = slots[next].hash & mask;
+      bool stays = (pos <= next) ? (pos < home && home <= next) : (pos < home || home <= next);
+      if (!stays) break;
     }
+    slots[pos] = slots[next];
+    pos = next;
   }
-  
+}
+
+int HashIndex::next(uint32_t hash, size_t& probe) const {
+  size_t mask = slots.size() - 1;
+  while (probe < slots.size()) {
+    const IndexSlot& s = slots[(hash + probe) & mask];
+    ++probe;
+    if (s.index == INDEX_EMPTY) return -1;
+    if (s.hash == hash) return s.index;
+  }
+  return -1;
+}
+
+ProductRegistry::ProductRegistry() : catalog() {
+  // Pools sized once; clearRegistry() keeps the capacity
+  products.reserve(REGISTRY_MAX_PRODUCTS);
+  modules.reserve(REGISTRY_MAX_MODULES);
+  productByCode.reserve(REGISTRY_MAX_PRODUCTS);
+  moduleByUID.reserve(REGISTRY_MAX_MODULES);
+  moduleByCode.reserve(REGISTRY_MAX_MODULES);
+  for (auto& slot : moduleByAddress) slot = -1;
+}
+
+void ProductRegistry::indexModule(uint16_t i) {
+  ProductModule& m = modules[i];
+  if (m.i2cAddress < REGISTRY_ADDRESS_SLOTS && moduleByAddress[m.i2cAddress] < 0) {
+    moduleByAddress[m.i2cAddress] = i;
+  }
+  if (m.moduleUID[0]) moduleByUID.insert(HashIndex::hashOf(m.moduleUID), i);
+  if (m.itemCode[0]) moduleByCode.insert(HashIndex::hashOf(m.itemCode), i);
+}
+
+void ProductRegistry::unindexModule(uint16_t i) {
+  ProductModule& m = modules[i];
+  if (m.i2cAddress < REGISTRY_ADDRESS_SLOTS && moduleByAddress[m.i2cAddress] == i) {
+    // Another module may share the address (rare): hand the slot on
+    moduleByAddress[m.i2cAddress] = -1;
+    for (size_t j = 0; j < modules.size(); ++j) {
+      if (j != i && modules[j].i2cAddress == m.i2cAddress) {
+        moduleByAddress[m.i2cAddress] = (int16_t)j;
+        break;
+      }
+    }
+  }
+  if (m.moduleUID[0]) moduleByUID.erase(HashIndex::hashOf(m.moduleUID), i);
+  if (m.itemCode[0]) moduleByCode.erase(HashIndex::hashOf(m.itemCode), i);
+}
+
+void ProductRegistry::rebuildIndexes() {
+  productByCode.clear();
+  moduleByUID.clear();
+  moduleByCode.clear();
+  for (auto& slot : moduleByAddress) slot = -1;
+  for (size_t i = 0; i < products.size(); ++i) {
+    productByCode.insert(HashIndex::hashOf(products[i].itemCode), (uint16_t)i);
+  }
+  for (size_t i = 0; i < modules.size(); ++i) indexModule((uint16_t)i);
+}
+
+// ===================== PRODUCT MANAGEMENT =============================
+
+void copyField(char* dst, size_t cap, const char* src) {
+  size_t n = strlen(src);
+  if (n > cap - 1) n = cap - 1;
+  memcpy(dst, src, n);
+  dst[n] = '\0';
+}
+
+void ProductRegistry::beginCatalog(const ProductRegistry& active) {
+  catalogBegin(active.catalog);
+}
+
+void ProductRegistry::addProduct(const char* code, const char* name, int stock, bool available) {
+  // Avoid duplicates (the first row's name is the one in the catalog)
+  ProductItem* existing = findProduct(code);
+  if (existing) {
+    if (existing->stock != stock || existing->available != available) existing->dirty = true;
+    existing->stock = stock;
+    existing->available = available;
+    return;
+  }
+
   ProductItem item;
-  item.itemCode = code;
-  item.name = name;
+  ptrdiff_t relocate;
+  if (!catalogAppend(code, name, item.itemCode, item.name, relocate)) {
+    logError(ERR_SHEETS_SYNC, "Catalog image full or unwritable", code);
+    return;
+  }
+  if (relocate) {
+    for (auto& p : products) {
+      p.itemCode += relocate;
+      p.name += relocate;
+    }
+  }
   item.stock = stock;
+  item.generation = newGeneration();
   item.targetAmount = 1;
   item.available = available;
+  item.dirty = true;
+  // Within the reserved pool this never allocates; a larger catalog
+  // still works, at the cost of the vector growing
   products.push_back(item);
+  productByCode.insert(HashIndex::hashOf(item.itemCode), (uint16_t)(products.size() - 1));
 }
 
-ProductItem* ProductRegistry::findProduct(const String& code) {
-  for (auto& p : products) {
-    if (p.itemCode == code) return &p;
+bool ProductRegistry::commitCatalog() {
+  CatalogView image;
+  ptrdiff_t relocate;
+  if (!catalogCommit(image, relocate)) return false;
+  if (relocate) {
+    for (auto& p : products) {
+      p.itemCode += relocate;
+      p.name += relocate;
+    }
+  }
+  catalog = image;
+  return true;
+}
+
+ProductItem* ProductRegistry::findProduct(const char* code) {
+  uint32_t h = HashIndex::hashOf(code);
+  size_t probe = 0;
+  for (int i; (i = productByCode.next(h, probe)) >= 0;) {
+    if (strcmp(products[i].itemCode, code) == 0) return &products[i];
   }
   return nullptr;
 }
 
+// ===================== LATENCY HISTOGRAMS ===========================
+
+static uint8_t latencyBucket(unsigned long ms) {
+  uint8_t b = 0;
+  while (ms > 0 && b < LATENCY_BUCKETS - 1) {
+    ms >>= 1;
+    ++b;
+  }
+  return b;
+}
+
+void LatencyHistogram::record(unsigned long ms) {
+  uint8_t b = latencyBucket(ms);
+  if (counts[b] == 0xFF) {
+    for (uint8_t i = 0; i < LATENCY_BUCKETS; ++i) counts[i] >>= 1;
+  }
+  ++counts[b];
+}
+
+uint16_t LatencyHistogram::samples() const {
+  uint16_t n = 0;
+  for (uint8_t i = 0; i < LATENCY_BUCKETS; ++i) n += counts[i];
+  return n;
+}
+
+uint32_t LatencyHistogram::percentile(uint8_t pct) const {
+  uint32_t total = samples();
+  if (total == 0) return 0;
+  uint32_t seen = 0;
+  for (uint8_t b = 0; b < LATENCY_BUCKETS; ++b) {
+    seen += counts[b];
+    if (seen * 100 >= total * pct) return 1UL << b;
+  }
+  return 1UL << (LATENCY_BUCKETS - 1);
+}
+
 // ===================== MODULE MANAGEMENT ==========================
 
-void ProductRegistry::addModule(uint8_t addr, const String& uid, const String& code, const String& name, int stock) {
+void ProductRegistry::addModule(uint8_t addr, const char* uid, const char* code, int stock) {
   // Avoid duplicates
-  for (auto& m : modules) {
-    if (m.i2cAddress == addr) {
-      m.moduleUID =     uid;
-      m.itemCode =      code;
-      m.name =          name;
-      m.stock =         stock;
-      m.lastSeen =      millis();
-      m.online =        true;
-      return;
+  ProductModule* existing = findModuleByAddress(addr);
+  if (existing) {
+    // A different module answering at this address is a new record
+    if (existing->moduleUID[0] && strcmp(existing->moduleUID, uid) != 0) {
+      existing->generation = newGeneration();
+    }
+    if (strcmp(existing->itemCode, code) != 0 || existing->stock != stock || !existing->online) {
+      existing->dirty = true;
     }
+    setModuleUID(existing, uid);
+    setModuleCode(existing, code);
+    existing->stock =     stock;
+    existing->lastSeen =  millis();
+    existing->online =    true;
+    return;
   }
   
+  if (modules.size() >= REGISTRY_MAX_MODULES) {
+    logError(ERR_I2C_COMM, "Module pool full", uid);
+    return;
+  }
   ProductModule module;
   module.i2cAddress =   addr;
-  module.moduleUID =    uid;
-  module.itemCode =     code;
-  module.name =         name;
+  copyField(module.moduleUID, sizeof(module.moduleUID), uid);
+  copyField(module.itemCode, sizeof(module.itemCode), code);
   module.stock =        stock;
   module.healthy =      true;
   module.online =       true;
   module.lastSeen =     millis();
+  module.latencyMs =    0;
+  module.missStreak =   0;
+  memset(module.latency, 0, sizeof(module.latency));
+  module.generation =   newGeneration();
+  module.dirty =        true;
   modules.push_back(module);
+  indexModule((uint16_t)(modules.size() - 1));
 }
 
 void ProductRegistry::updateModuleStock(uint8_t addr, int stock) {
-  for (auto& m : modules) {
-    if (m.i2cAddress == addr) {
-      m.stock = stock;
-      m.lastSeen = millis();
-      return;
-    }
+  ProductModule* m = findModuleByAddress(addr);
+  if (m) {
+    if (m->stock != stock) m->dirty = true;
+    m->stock = stock;
+    m->lastSeen = millis();
   }
 }
 
 void ProductRegistry::updateModuleHealth(uint8_t addr, bool online) {
-  for (auto& m : modules) {
-    if (m.i2cAddress == addr) {
-      m.online = online;
-      if (online) {
-        m.lastSeen = millis();
-      }
-      return;
+  ProductModule* m = findModuleByAddress(addr);
+  if (m) {
+    // Back on the bus: its display may be stale
+    if (online && !m->online) m->dirty = true;
+    m->online = online;
+    if (online) {
+      m->lastSeen = millis();
     }
   }
 }
 
-ProductModule* ProductRegistry::findModuleByCode(const String& code) {
-  for (auto& m : modules) {
-    if (m.itemCode == code) return &m;
+// Modules may share a code; the earliest one wins, as with a linear scan
+ProductModule* ProductRegistry::findModuleByCode(const char* code) {
+  if (!code[0]) return nullptr;
+  uint32_t h = HashIndex::hashOf(code);
+  size_t probe = 0;
+  int best = -1;
+  for (int i; (i = moduleByCode.next(h, probe)) >= 0;) {
+    if ((best < 0 || i < best) && strcmp(modules[i].itemCode, code) == 0) best = i;
   }
-  return nullptr;
+  return best >= 0 ? &modules[best] : nullptr;
 }
 
 ProductModule* ProductRegistry::findModuleByAddress(uint8_t addr) {
-  for (auto& m : modules) {
-    if (m.i2cAddress == addr) return &m;
+  if (addr >= REGISTRY_ADDRESS_SLOTS || moduleByAddress[addr] < 0) return nullptr;
+  return &modules[moduleByAddress[addr]];
+}
+
+ProductModule* ProductRegistry::findModuleByUID(const char* uid) {
+  if (!uid[0]) return nullptr;
+  uint32_t h = HashIndex::hashOf(uid);
+  size_t probe = 0;
+  int best = -1;
+  for (int i; (i = moduleByUID.next(h, probe)) >= 0;) {
+    if ((best < 0 || i < best) && strcmp(modules[i].moduleUID, uid) == 0) best = i;
+  }
+  return best >= 0 ? &modules[best] : nullptr;
+}
+
+ProductModule* ProductRegistry::findModuleByUIDHash(uint32_t hash) {
+  size_t probe = 0;
+  int best = -1;
+  for (int i; (i = moduleByUID.next(hash, probe)) >= 0;) {
+    if ((best < 0 || i < best) && HashIndex::hashOf(modules[i].moduleUID) == hash) best = i;
+  }
+  return best >= 0 ? &modules[best] : nullptr;
+}
+
+void ProductRegistry::setModuleAddress(ProductModule* m, uint8_t addr) {
+  if (m->i2cAddress == addr) return;
+  uint16_t i = (uint16_t)(m - &modules[0]);
+  unindexModule(i);
+  m->i2cAddress = addr;
+  indexModule(i);
+}
+
+void ProductRegistry::setModuleUID(ProductModule* m, const char* uid) {
+  if (strcmp(m->moduleUID, uid) == 0) return;
+  uint16_t i = (uint16_t)(m - &modules[0]);
+  unindexModule(i);
+  copyField(m->moduleUID, sizeof(m->moduleUID), uid);
+  indexModule(i);
+}
+
+void ProductRegistry::setModuleCode(ProductModule* m, const char* code) {
+  if (strcmp(m->itemCode, code) == 0) return;
+  uint16_t i = (uint16_t)(m - &modules[0]);
+  unindexModule(i);
+  copyField(m->itemCode, sizeof(m->itemCode), code);
+  indexModule(i);
+}
+
+const char* ProductRegistry::moduleName(const ProductModule& m) {
+  if (!m.itemCode[0]) return "New Module";
+  ProductItem* p = findProduct(m.itemCode);
+  return p ? p->name : "";
+}
+
+// ===================== HANDLES ======================================
+// Resolving checks the hinted slot first; after a swap or a resync the
+// record may sit elsewhere, so fall back to a scan by generation.
+
+ProductHandle ProductRegistry::handleOf(const ProductItem* p) const {
+  ProductHandle h = { 0, 0 };
+  if (!p || products.empty()) return h;
+  h.slot = (uint16_t)(p - &products[0]);
+  h.generation = p->generation;
+  return h;
+}
+
+ModuleHandle ProductRegistry::handleOf(const ProductModule* m) const {
+  ModuleHandle h = { 0, 0 };
+  if (!m || modules.empty()) return h;
+  h.slot = (uint16_t)(m - &modules[0]);
+  h.generation = m->generation;
+  return h;
+}
+
+ProductItem* ProductRegistry::resolve(ProductHandle h) {
+  if (!h.valid()) return nullptr;
+  if (h.slot < products.size() && products[h.slot].generation == h.generation) return &products[h.slot];
+  for (auto& p : products) {
+    if (p.generation == h.generation) return &p;
   }
   return nullptr;
 }
 
-ProductModule* ProductRegistry::findModuleByUID(const String& uid) {
+ProductModule* ProductRegistry::resolve(ModuleHandle h) {
+  if (!h.valid()) return nullptr;
+  if (h.slot < modules.size() && modules[h.slot].generation == h.generation) return &modules[h.slot];
   for (auto& m : modules) {
-    if (m.moduleUID == uid) return &m;
+    if (m.generation == h.generation) return &m;
   }
   return nullptr;
 }
 
 // ===================== ERROR LOGGING ================================
+// Multi-producer ring: a writer claims a ticket with one atomic add and
+// fills slot (ticket % capacity). Each slot carries a sequence word, odd
+// while being written, so readers can drop torn or overwritten entries
+// without a lock.
 
-void ProductRegistry::logError(ErrorCode code, const String& message, const String& affectedItem) {
-  ErrorLog err;
-  err.code =          code;
-  err.message =       message;
-  err.timestamp =     millis();
-  err.affectedItem =  affectedItem;
-  errorLogs.push_back(err);
-  
-  // Keep only last 50 errors
-  if (errorLogs.size() > 50) {
-    errorLogs.erase(errorLogs.begin());
+struct ErrorSlot {
+  std::atomic<uint32_t> seq;   // 2*ticket + 1 while writing, 2*ticket + 2 when done
+  ErrorLog entry;
+};
+
+struct ErrorCounter {
+  std::atomic<uint32_t> count;
+  std::atomic<uint32_t> firstSeen;
+  std::atomic<uint32_t> lastSeen;
+};
+
+static ErrorSlot s_errorRing[ERROR_LOG_CAPACITY];
+static std::atomic<uint32_t> s_errorTicket(0);
+static ErrorCounter s_errorCounters[ERR_CODE_COUNT];
+
+// Claims a slot and fills everything but affectedItem; finish with
+// publishError()
+static ErrorSlot& claimError(ErrorCode code, const char* message, uint32_t& ticket) {
+  uint32_t now = millis();
+  if (code < ERR_CODE_COUNT) {
+    ErrorCounter& c = s_errorCounters[code];
+    c.count.fetch_add(1, std::memory_order_relaxed);
+    uint32_t never = 0;
+    c.firstSeen.compare_exchange_strong(never, now ? now : 1, std::memory_order_relaxed);
+    c.lastSeen.store(now, std::memory_order_relaxed);
   }
+
+  ticket = s_errorTicket.fetch_add(1, std::memory_order_relaxed);
+  ErrorSlot& slot = s_errorRing[ticket & (ERROR_LOG_CAPACITY - 1)];
+  slot.seq.store(2 * ticket + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.entry.timestamp = now;
+  slot.entry.message = message;
+  slot.entry.code = (uint8_t)code;
+  return slot;
+}
+
+static void publishError(ErrorSlot& slot, uint32_t ticket) {
+  slot.seq.store(2 * ticket + 2, std::memory_order_release);
+}
+
+void ProductRegistry::logError(ErrorCode code, const char* message, const char* affectedItem) {
+  uint32_t ticket;
+  ErrorSlot& slot = claimError(code, message, ticket);
+  copyField(slot.entry.affectedItem, sizeof(slot.entry.affectedItem), affectedItem);
+  publishError(slot, ticket);
+}
+
+void ProductRegistry::logError(ErrorCode code, const char* message, uint8_t i2cAddress) {
+  uint32_t ticket;
+  ErrorSlot& slot = claimError(code, message, ticket);
+  utoa(i2cAddress, slot.entry.affectedItem, 10);
+  publishError(slot, ticket);
+}
+
+size_t ProductRegistry::readErrorLogs(ErrorLog* out, size_t max) {
+  uint32_t next = s_errorTicket.load(std::memory_order_acquire);
+  size_t n = 0;
+  for (uint32_t k = 1; k <= ERROR_LOG_CAPACITY && k <= next && n < max; ++k) {
+    uint32_t ticket = next - k;
+    ErrorSlot& slot = s_errorRing[ticket & (ERROR_LOG_CAPACITY - 1)];
+    uint32_t before = slot.seq.load(std::memory_order_acquire);
+    if (before != 2 * ticket + 2) continue;   // Still being written or already reused
+    out[n] = slot.entry;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) != before) continue;
+    ++n;
+  }
+  return n;
+}
+
+ErrorStats ProductRegistry::errorStats(ErrorCode code) {
+  ErrorStats stats = { 0, 0, 0 };
+  if (code >= ERR_CODE_COUNT) return stats;
+  stats.count = s_errorCounters[code].count.load(std::memory_order_relaxed);
+  stats.firstSeen = s_errorCounters[code].firstSeen.load(std::memory_order_relaxed);
+  stats.lastSeen = s_errorCounters[code].lastSeen.load(std::memory_order_relaxed);
+  return stats;
 }
 
 // ===================== REGISTRY OPERATIONS ===========================
@@ -124,12 +518,305 @@ void ProductRegistry::logError(ErrorCode code, const String& message, const Stri
 void ProductRegistry::clearRegistry() {
   products.clear();
   modules.clear();
+  rebuildIndexes();
 }
 
 bool ProductRegistry::validateProductExists(const String& code) {
   return findProduct(code) != nullptr;
 }
 
+void ProductRegistry::adoptRuntimeState(const ProductRegistry& previous) {
+  // Same product code, same product: keep handles taken before the
+  // swap, and flag only what this sync actually changed
+  for (auto& p : products) p.dirty = true;
+  for (auto& old : previous.products) {
+    ProductItem* p = findProduct(old.itemCode);
+    if (!p) continue;
+    p->generation = old.generation;
+    p->dirty = old.dirty || p->stock != old.stock || p->available != old.available ||
+               (p->name != old.name && strcmp(p->name, old.name) != 0);
+  }
+
+  for (auto& old : previous.modules) {
+    // Match by UID first: a bus scan may have moved a module's address
+    ProductModule* m = findModuleByUID(old.moduleUID);
+    bool sameModule = m != nullptr;
+    if (!m) m = findModuleByAddress(old.i2cAddress);
+    if (!m) {
+      // Found by a bus scan but not (yet) in the sheets: keep it
+      if (modules.size() >= REGISTRY_MAX_MODULES) continue;
+      modules.push_back(old);   // Keeps its dirty flag
+      indexModule((uint16_t)(modules.size() - 1));
+      continue;
+    }
+    setModuleAddress(m, old.i2cAddress);
+    if (!m->moduleUID[0]) setModuleUID(m, old.moduleUID);
+    // Only the address matched: it may be a new or re-addressed module,
+    // so it keeps the fresh record's handle, health and latency history
+    if (!sameModule) continue;
+    m->generation = old.generation;
+    // Anything the display shows is unchanged: nothing to push
+    m->dirty = old.dirty || strcmp(m->itemCode, old.itemCode) != 0 || m->stock != old.stock;
+    m->healthy =  old.healthy;
+    m->online =   old.online;
+    m->lastSeen = old.lastSeen;
+    m->latencyMs = old.latencyMs;
+    m->missStreak = old.missStreak;
+    memcpy(m->latency, old.latency, sizeof(m->latency));
+  }
+}
+
+// ===================== PERSISTENCE ===================================
+// Product codes and names are in the catalog image, so the snapshot only
+// records which image it belongs to plus the mutable fields.
+// Image layout (little-endian):
+//   header:  magic u32, version u16, catalog sequence u32, products u16,
+//            modules u16, crc32 u32
+//   product: stock i32, targetAmount u8, available u8 (catalog order)
+//   module:  addr u8, uid str, code str, stock i32
+// where str = u8 length + bytes. The CRC covers everything after the header.
+
+static const uint32_t SNAPSHOT_MAGIC = 0x47455256;   // "VREG"
+static const uint16_t SNAPSHOT_VERSION = 2;
+static const size_t SNAPSHOT_HEADER = 18;
+
+// Header of the snapshot now in LittleFS (saved or loaded this boot). It
+// includes the CRC, so an identical image is recognised without a read.
+static uint8_t s_storedHeader[SNAPSHOT_HEADER];
+static bool s_haveStoredHeader = false;
+
+bool mountStorage() {
+  static bool mounted = false;
+  if (!mounted) {
+    mounted = LittleFS.begin(true);   // Format on first use
+    if (!mounted) Serial.println("LittleFS mount failed");
+  }
+  return mounted;
+}
+
+static void putU8(std::vector<uint8_t> &out, uint8_t v) { out.push_back(v); }
+
+static void putU16(std::vector<uint8_t> &out, uint16_t v) {
+  out.push_back(v & 0xFF);
+  out.push_back(v >> 8);
+}
+
+static void putU32(std::vector<uint8_t> &out, uint32_t v) {
+  for (int i = 0; i < 4; ++i) out.push_back((v >> (8 * i)) & 0xFF);
+}
+
+static void putStr(std::vector<uint8_t> &out, const char *s) {
+  size_t n = strlen(s);
+  if (n > 255) n = 255;
+  out.push_back((uint8_t)n);
+  out.insert(out.end(), s, s + n);
+}
+
+// Bounds-checked reader over a loaded image
+struct SnapshotReader {
+  const uint8_t *buf;
+  size_t len;
+  size_t pos;
+  bool ok;
+
+  bool take(size_t n) {
+    if (!ok || pos + n > len) ok = false;
+    return ok;
+  }
+  uint8_t u8() {
+    if (!take(1)) return 0;
+    return buf[pos++];
+  }
+  uint16_t u16() {
+    if (!take(2)) return 0;
+    uint16_t v = buf[pos] | (buf[pos + 1] << 8);
+    pos += 2;
+    return v;
+  }
+  uint32_t u32() {
+    if (!take(4)) return 0;
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) v |= (uint32_t)buf[pos + i] << (8 * i);
+    pos += 4;
+    return v;
+  }
+  // Into a fixed field of `cap` bytes, truncating
+  void str(char *out, size_t cap) {
+    uint8_t n = u8();
+    out[0] = '\0';
+    if (!take(n)) return;
+    size_t k = n < cap - 1 ? n : cap - 1;
+    memcpy(out, buf + pos, k);
+    out[k] = '\0';
+    pos += n;
+  }
+};
+
+bool ProductRegistry::saveSnapshot() const {
+  if (!catalog.valid() || !mountStorage()) return false;
+
+  std::vector<uint8_t> image;
+  image.reserve(SNAPSHOT_HEADER + products.size() * 6 + modules.size() * 32);
+  image.resize(SNAPSHOT_HEADER);
+  for (auto &p : products) {
+    putU32(image, (uint32_t)p.stock);
+    putU8(image, (uint8_t)p.targetAmount);
+    putU8(image, p.available ? 1 : 0);
+  }
+  for (auto &m : modules) {
+    putU8(image, m.i2cAddress);
+    putStr(image, m.moduleUID);
+    putStr(image, m.itemCode);
+    putU32(image, (uint32_t)m.stock);
+  }
+
+  std::vector<uint8_t> header;
+  putU32(header, SNAPSHOT_MAGIC);
+  putU16(header, SNAPSHOT_VERSION);
+  putU32(header, catalog.sequence);
+  putU16(header, (uint16_t)products.size());
+  putU16(header, (uint16_t)modules.size());
+  putU32(header, crc32_le(0, image.data() + SNAPSHOT_HEADER, image.size() - SNAPSHOT_HEADER));
+  memcpy(image.data(), header.data(), SNAPSHOT_HEADER);
+
+  // loadSnapshot() would reject it as corrupt
+  if (image.size() > REGISTRY_SNAPSHOT_MAX) {
+    Serial.println("Registry snapshot: image too large, not saved");
+    return false;
+  }
+
+  // A quiet sync changes nothing: don't rewrite the same bytes
+  if (s_haveStoredHeader && memcmp(s_storedHeader, image.data(), SNAPSHOT_HEADER) == 0) return true;
+
+  // Write beside the live image and rename over it (LittleFS replaces
+  // the target atomically), so a power cut at any point leaves either
+  // the previous snapshot or the new one
+  String tmpPath = String(REGISTRY_SNAPSHOT_PATH) + ".tmp";
+  File f = LittleFS.open(tmpPath, "w");
+  if (!f) {
+    Serial.println("Registry snapshot: open for write failed");
+    return false;
+  }
+  size_t written = f.write(image.data(), image.size());
+  f.close();
+  if (written != image.size()) {
+    Serial.println("Registry snapshot: short write");
+    LittleFS.remove(tmpPath);
+    return false;
+  }
+  if (!LittleFS.rename(tmpPath, REGISTRY_SNAPSHOT_PATH)) {
+    Serial.println("Registry snapshot: rename failed");
+    LittleFS.remove(tmpPath);
+    return false;
+  }
+
+  memcpy(s_storedHeader, image.data(), SNAPSHOT_HEADER);
+  s_haveStoredHeader = true;
+
+  Serial.print("Registry snapshot saved (");
+  Serial.print((int)image.size());
+  Serial.println(" bytes)");
+  return true;
+}
+
+bool ProductRegistry::loadSnapshot() {
+  if (!mountStorage() || !LittleFS.exists(REGISTRY_SNAPSHOT_PATH)) return false;
+
+  File f = LittleFS.open(REGISTRY_SNAPSHOT_PATH, "r");
+  if (!f) return false;
+  size_t size = f.size();
+  if (size < SNAPSHOT_HEADER || size > REGISTRY_SNAPSHOT_MAX) {
+    f.close();
+    Serial.println("Registry snapshot: bad size");
+    return false;
+  }
+  std::vector<uint8_t> image(size);
+  size_t got = f.read(image.data(), size);
+  f.close();
+  if (got != size) return false;
+
+  SnapshotReader r = { image.data(), image.size(), 0, true };
+  uint32_t magic = r.u32();
+  uint16_t version = r.u16();
+  uint32_t catalogSequence = r.u32();
+  uint16_t productCount = r.u16();
+  uint16_t moduleCount = r.u16();
+  uint32_t crc = r.u32();
+  if (magic != SNAPSHOT_MAGIC || version != SNAPSHOT_VERSION ||
+      crc != crc32_le(0, image.data() + SNAPSHOT_HEADER, size - SNAPSHOT_HEADER)) {
+    Serial.println("Registry snapshot: header or CRC mismatch; ignoring");
+    return false;
+  }
+
+  // The catalog image the snapshot was taken against must still exist
+  CatalogView source;
+  if (!catalogFind(catalogSequence, source) || source.count != productCount) {
+    Serial.println("Registry snapshot: catalog image not found; ignoring");
+    return false;
+  }
+
+  // Decode into temporaries so a truncated image changes nothing
+  std::vector<ProductItem> loadedProducts;
+  std::vector<ProductModule> loadedModules;
+  loadedProducts.reserve(productCount);
+  if (moduleCount > REGISTRY_MAX_MODULES) {
+    Serial.println("Registry snapshot: too many modules; ignoring");
+    return false;
+  }
+  loadedModules.reserve(moduleCount);
+  uint32_t recordOffset = 0;
+  for (uint16_t i = 0; i < productCount && r.ok; ++i) {
+    ProductItem p;
+    if (!catalogNext(source, recordOffset, p.itemCode, p.name)) return false;
+    p.stock =         (int)r.u32();
+    p.targetAmount =  r.u8();
+    p.available =     r.u8() != 0;
+    p.generation =    newGeneration();
+    p.dirty =         true;
+    loadedProducts.push_back(p);
+  }
+  for (uint16_t i = 0; i < moduleCount && r.ok; ++i) {
+    ProductModule m;
+    m.i2cAddress =    r.u8();
+    r.str(m.moduleUID, sizeof(m.moduleUID));
+    r.str(m.itemCode, sizeof(m.itemCode));
+    m.stock =         (int)r.u32();
+    // Reachability is only known after a bus scan
+    m.healthy =       true;
+    m.online =        false;
+    m.lastSeen =      0;
+    m.latencyMs =     0;
+    m.missStreak =    0;
+    memset(m.latency, 0, sizeof(m.latency));
+    m.generation =    newGeneration();
+    m.dirty =         true;
+    loadedModules.push_back(m);
+  }
+  if (!r.ok) {
+    Serial.println("Registry snapshot: truncated; ignoring");
+    return false;
+  }
+
+  // assign() rather than swap() keeps the reserved pools
+  products.assign(loadedProducts.begin(), loadedProducts.end());
+  modules.assign(loadedModules.begin(), loadedModules.end());
+  catalog = source;
+  rebuildIndexes();
+  memcpy(s_storedHeader, image.data(), SNAPSHOT_HEADER);
+  s_haveStoredHeader = true;
+  return true;
+}
+
+// ===================== GLOBAL REGISTRY ===============================
+
+ProductRegistry& backRegistry() {
+  return (g_registry == &s_registries[0]) ? s_registries[1] : s_registries[0];
+}
+
+void swapRegistries() {
+  g_registry = &backRegistry();
+}
+
 // ===================== DEBUG PRINT HELPERS ===========================
 
 void ProductRegistry::debugPrintProducts() {
@@ -162,10 +849,49 @@ void ProductRegistry::debugPrintModules() {
     Serial.print(" (dec="); Serial.print((int)m.i2cAddress); Serial.print(")");
     Serial.print(" uid="); Serial.print(m.moduleUID);
     Serial.print(" code="); Serial.print(m.itemCode);
-    Serial.print(" name="); Serial.print(m.name);
+    Serial.print(" name="); Serial.print(moduleName(m));
     Serial.print(" stock="); Serial.print(m.stock);
     Serial.print(" healthy="); Serial.print(m.healthy ? "true" : "false");
     Serial.print(" online="); Serial.print(m.online ? "true" : "false");
-    Serial.print(" lastSeen="); Serial.println(m.lastSeen);
+    Serial.print(" lastSeen="); Serial.print(m.lastSeen);
+    Serial.print(" latencyMs="); Serial.print(m.latencyMs);
+    Serial.print(" missStreak="); Serial.println(m.missStreak);
+    static const char* const classNames[LAT_CLASS_COUNT] = { "poll", "whoami", "display", "dispense" };
+    Serial.print("    p50/p99 ms:");
+    for (uint8_t c = 0; c < LAT_CLASS_COUNT; ++c) {
+      Serial.print(" "); Serial.print(classNames[c]); Serial.print("=");
+      if (m.latency[c].samples() == 0) {
+        Serial.print("-");
+        continue;
+      }
+      Serial.print(m.latency[c].percentile(50)); Serial.print("/");
+      Serial.print(m.latency[c].percentile(99));
+    }
+    Serial.println();
+  }
+}
+
+void ProductRegistry::debugPrintErrors() {
+  Serial.println("--- Error Counters ---");
+  for (int c = 1; c < ERR_CODE_COUNT; ++c) {
+    ErrorStats st = errorStats((ErrorCode)c);
+    if (st.count == 0) continue;
+    Serial.print("code="); Serial.print(c);
+    Serial.print(" count="); Serial.print(st.count);
+    Serial.print(" first="); Serial.print(st.firstSeen);
+    Serial.print(" last="); Serial.println(st.lastSeen);
+  }
+  ErrorLog recent[8];
+  size_t n = readErrorLogs(recent, 8);
+  Serial.println("--- Recent Errors ---");
+  if (n == 0) Serial.println("(none)");
+  for (size_t i = 0; i < n; ++i) {
+    Serial.print("["); Serial.print(recent[i].timestamp); Serial.print("] ");
+    Serial.print("code="); Serial.print((int)recent[i].code);
+    Serial.print(" "); Serial.print(recent[i].message);
+    if (recent[i].affectedItem[0]) {
+      Serial.print(" ("); Serial.print(recent[i].affectedItem); Serial.print(")");
+    }
+    Serial.println();
   }
 }
@@ -9,7 +9,7 @@
 volatile State currentState = STATE_IDLE;
 String inputBuffer = "";
 String selectedCode = "";
-ProductModule* selectedModule = nullptr;
+ModuleHandle selectedModule = ModuleHandle();   // Re-resolved on each use
 unsigned long stateEnteredAt = 0;
 unsigned long confirmDeadline = 0;
 unsigned long syncTimer = 0;
@@ -50,18 +50,53 @@ static State transitionTable[9][13] = {
   {STATE_ERROR, STATE_ERROR, STATE_ERROR, STATE_ERROR, STATE_ERROR, STATE_ERROR, STATE_ERROR, STATE_ERROR, STATE_ERROR, STATE_ERROR, STATE_IDLE, STATE_IDLE, STATE_ERROR}
 };
 
+// ===================== POSTED EVENTS ==================================
+// Small FIFO filled by callbacks and drained by detectEvent(); loop task only
+
+#define POSTED_EVENT_SLOTS 4
+
+static Event postedEvents[POSTED_EVENT_SLOTS];
+static uint8_t postedHead = 0;
+static uint8_t postedCount = 0;
+
+void postEvent(Event evt) {
+  if (evt == EVT_NONE || postedCount >= POSTED_EVENT_SLOTS) return;
+  postedEvents[(postedHead + postedCount) % POSTED_EVENT_SLOTS] = evt;
+  ++postedCount;
+}
+
+Event takePostedEvent() {
+  if (postedCount == 0) return EVT_NONE;
+  Event evt = postedEvents[postedHead];
+  postedHead = (postedHead + 1) % POSTED_EVENT_SLOTS;
+  --postedCount;
+  return evt;
+}
+
+// Dispense completion from the I2C engine
+static void onDispenseDone(bool ok) {
+  if (ok) {
+    postEvent(EVT_DISPENSE_ACK);
+    return;
+  }
+  lastErrorCode = ERR_DISPENSE_FAILED;
+  lastErrorMsg = "Dispense failed";
+  postEvent(EVT_ERROR_OCCURRED);
+}
+
 // ===================== FSM INITIALIZATION =============================
 
 void initFSM() {
   currentState       = STATE_IDLE;
   inputBuffer        = "";
   selectedCode       = "";
-  selectedModule     = nullptr;
+  selectedModule     = ModuleHandle();
   stateEnteredAt     = millis();
   confirmDeadline    = 0;
   syncTimer          = millis();
   lastErrorCode      = ERR_NONE;
   lastErrorMsg       = "";
+  postedCount        = 0;
 }
 
 // ===================== STATE ENTRY HANDLER =============================
@@ -75,7 +110,7 @@ void onStateEntry(State s) {
     case STATE_IDLE:
       inputBuffer = "";
       selectedCode = "";
-      selectedModule = nullptr;
+      selectedModule = ModuleHandle();
       lcd.clear();
       lcd.setCursor(0, 1);
       lcd.print("VENDISELL");
@@ -102,25 +137,29 @@ void onStateEntry(State s) {
       lcd.print(selectedCode.c_str());
       break;
       
-    case STATE_WAIT_CONFIRM:
+    case STATE_WAIT_CONFIRM: {
       confirmDeadline = millis() + PAYMENT_TIMEOUT_MS;
       lcd.clear();
       lcd.setCursor(0, 0);
       lcd.print("Ready: ");
-      if (selectedModule) {
-        lcd.print(selectedModule->name.c_str());
+      ProductModule* module = g_registry->resolve(selectedModule);
+      if (module) {
+        lcd.print(g_registry->moduleName(*module));
       }
       lcd.setCursor(0, 1);
       lcd.print("[*]Cancel [#]Confirm");
       break;
+    }
       
-    case STATE_DISPENSE:
+    case STATE_DISPENSE: {
       lcd.clear();
       lcd.setCursor(0, 0);
       lcd.print("Dispensing...");
       lcd.setCursor(0, 1);
-      lcd.print(selectedModule ? selectedModule->name.c_str() : "Unknown");
+      ProductModule* module = g_registry->resolve(selectedModule);
+      lcd.print(module ? g_registry->moduleName(*module) : "Unknown");
       break;
+    }
       
     case STATE_THANK_YOU:
       lcd.clear();
@@ -173,13 +212,20 @@ void onStateExit(State s) {
 
 void onStateAction(State s) {
   unsigned long now = millis();
+
+  // A finished background sync is swapped in whatever the state: the FSM
+  // only keeps a handle to the selected module and resolves it on use
+  if (publishSheetsSync()) {
+    matchModulesToSheets();
+    syncModuleDisplays();
+  }
   
   switch (s) {
     case STATE_IDLE:
-      // Periodically sync with Google Sheets every 30 seconds
+      // Periodically sync with Google Sheets every 30 seconds. The sync
+      // runs on the Sheets task.
       if (now - syncTimer > SYNC_INTERVAL_MS) {
-        syncProductDataFromSheets();
-        syncModuleDisplays();
+        requestSheetsSync();
         syncTimer = now;
       }
       break;
@@ -195,9 +241,22 @@ void onStateAction(State s) {
       }
       break;
       
-    case STATE_CHECK_AVAIL:
-      // Handled by event processing
+    case STATE_CHECK_AVAIL: {
+      if (now - stateEnteredAt < CHECK_AVAIL_MS) break;
+      ProductModule* module = g_registry->resolve(selectedModule);
+      if (!module) {
+        lastErrorCode = ERR_MODULE_OFFLINE;
+        lastErrorMsg = "Module lost";
+        processEvent(EVT_ERROR_OCCURRED);
+      } else if (module->stock > 0) {
+        Serial.println("stockavail");
+        processEvent(EVT_STOCK_AVAILABLE);
+      } else {
+        Serial.println("stockempty");
+        processEvent(EVT_STOCK_EMPTY);
+      }
       break;
+    }
       
     case STATE_WAIT_CONFIRM:
       // Check for timeout
@@ -317,9 +376,10 @@ bool handleItemSelectEvent(Event evt) {
     case EVT_KEY_SUBMIT: {
       // User submitted product code
       selectedCode = inputBuffer;
-      selectedModule = g_registry.findModuleByCode(selectedCode);
+      ProductModule* module = g_registry->findModuleByCode(selectedCode);
+      selectedModule = g_registry->handleOf(module);
       
-      if (!selectedModule) {
+      if (!module) {
         // Product not found
         lastErrorCode = ERR_INVALID_PRODUCT;
         lastErrorMsg = "Code not found";
@@ -327,25 +387,25 @@ bool handleItemSelectEvent(Event evt) {
         return false;
       }
       
-      if (!selectedModule->online) {
+      if (!module->online) {
         // Module offline
         lastErrorCode = ERR_MODULE_OFFLINE;
         lastErrorMsg = "Module offline";
         processEvent(EVT_ERROR_OCCURRED);
         return false;
       }
+
+      if (!module->healthy) {
+        // Module reported a mechanism fault (v2 STATUS)
+        lastErrorCode = ERR_DISPENSE_FAILED;
+        lastErrorMsg = "Module fault";
+        processEvent(EVT_ERROR_OCCURRED);
+        return false;
+      }
       
-      // Proceed to check availability
+      // Proceed to check availability; the verdict follows once
+      // "Checking stock..." has been shown (see onStateAction)
       enterState(STATE_CHECK_AVAIL);
-      delay(500);
-      
-      if (selectedModule->stock > 0) {
-        Serial.println("stockavail");
-        processEvent(EVT_STOCK_AVAILABLE);
-      } else {
-        Serial.println("stockempty");
-        processEvent(EVT_STOCK_EMPTY);
-      }
       return false;
     }
       
@@ -375,30 +435,23 @@ bool handleConfirmEvent(Event evt) {
     case EVT_KEY_SUBMIT: {
       // User confirmed purchase
       enterState(STATE_DISPENSE);
-      delay(500);
       
-      // Attempt to dispense
-      if (!selectedModule) {
+      // Attempt to dispense. The registry may have been swapped since
+      // the code was entered, so look the module up again.
+      ProductModule* module = g_registry->resolve(selectedModule);
+      if (!module) {
         lastErrorCode = ERR_MODULE_OFFLINE;
         lastErrorMsg = "Module lost";
         processEvent(EVT_ERROR_OCCURRED);
         return false;
       }
       
-      bool ok = i2c_dispense(selectedModule->i2cAddress);
-      if (ok) {
-        // Update stock
-        selectedModule->stock--;
-        g_registry.updateModuleStock(selectedModule->i2cAddress, selectedModule->stock);
-        
-        // Log to Google Sheets
-        logTransactionToSheets(selectedCode, 1);
-        updateStockInSheets(selectedCode, selectedModule->stock);
-        
-        processEvent(EVT_DISPENSE_ACK);
-      } else {
-        lastErrorCode = ERR_DISPENSE_FAILED;
-        lastErrorMsg = "Dispense failed";
+      // The dispense runs on the I2C engine while the keypad and LCD stay
+      // live. On ACK it books the sale (stock, ledger, Sheets queue) and
+      // onDispenseDone() posts the ACK or error event.
+      if (!i2c_dispenseAsync(module->i2cAddress, onDispenseDone)) {
+        lastErrorCode = ERR_I2C_COMM;
+        lastErrorMsg = "Module busy";
         processEvent(EVT_ERROR_OCCURRED);
       }
       return false;
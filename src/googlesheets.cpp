@@ -1,81 +1,21 @@
 #include "googlesheets.h"
 #include "config.h"
 #include "datatypes.h"
+#include "sheetsparser.h"
+#include "ledger.h"
 #include <WiFi.h>
+#include <WiFiClientSecure.h>
+#include <HTTPClient.h>
 #include <ESP_Google_Sheet_Client.h>
 #include "time.h"
 #include <vector>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 
 // Convenience alias for the library instance
 // The library provides a global `GSheet` instance (see examples)
 
-// Helper: parse the JSON string returned by GSheet.values.get(String*) for "values" array
-static void parseValuesJson(const String &json, std::vector<std::vector<String>> &outRows)
-{
-  outRows.clear();
-  int idx = json.indexOf("\"values\":");
-  if (idx < 0) return;
-
-  // find opening '[' of the values array
-  int start = json.indexOf('[', idx);
-  if (start < 0) return;
-
-  // find matching closing bracket for the values array
-  int depth = 0;
-  int end = -1;
-  for (int i = start; i < (int)json.length(); ++i) {
-    char c = json[i];
-    if (c == '[') ++depth;
-    else if (c == ']') {
-      --depth;
-      if (depth == 0) { end = i; break; }
-    }
-  }
-  if (end <= start) return;
-
-  String body = json.substring(start + 1, end); // content between outer [ ... ]
-
-  // Each row looks like ["A","B","C"] and rows are separated by ",["
-  int pos = 0;
-  while (pos < body.length()) {
-    // find next row start
-    int rowStart = body.indexOf('[', pos);
-    if (rowStart == -1) break;
-    int rowDepth = 0;
-    int rowEnd = -1;
-    for (int i = rowStart; i < (int)body.length(); ++i) {
-      char c = body[i];
-      if (c == '[') ++rowDepth;
-      else if (c == ']') { --rowDepth; if (rowDepth == 0) { rowEnd = i; break; } }
-    }
-    if (rowEnd == -1) break;
-
-    String row = body.substring(rowStart + 1, rowEnd); // e.g. "A","B","C"
-
-    std::vector<String> cols;
-    int p = 0;
-    while (p < row.length()) {
-      // find next quoted value
-      int q1 = row.indexOf('"', p);
-      if (q1 == -1) break;
-      int q2 = row.indexOf('"', q1 + 1);
-      if (q2 == -1) break;
-      String val = row.substring(q1 + 1, q2);
-      cols.push_back(val);
-      p = q2 + 1;
-      // skip comma or other separators
-      int comma = row.indexOf(',', p);
-      if (comma == -1) break;
-      p = comma + 1;
-    }
-
-    outRows.emplace_back();
-    for (auto &c : cols) outRows.back().push_back(c);
-
-    pos = rowEnd + 1;
-  }
-}
-
 // Helper: return current time as an ISO-like string using NTP/localtime
 static String getNtpTimeString()
 {
@@ -102,315 +42,1029 @@ static String getNtpTimeString()
   return String(millis());
 }
 
+// Timestamp for a ledger entry. A sale made before the clock was set is
+// dated back from now if the clock has been set since.
+static String transactionTimeString(const Transaction &t)
+{
+  time_t when = t.epoch;
+  if (when == 0) {
+    time_t now = time(nullptr);
+    if (now <= 1000000000) return String(t.timestamp);
+    when = now - (time_t)((millis() - t.timestamp) / 1000);
+  }
+  struct tm tmv;
+  char buf[32];
+  localtime_r(&when, &tmv);
+  strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tmv);
+  return String(buf);
+}
+
 void tokenStatusCallback(TokenInfo info);
 
-// ===================== WIFI CONNECTIVITY ============================
+// ===================== SHEETS CLIENT LOCK ===========================
+// GSheet is not re-entrant. The Sheets task and the main loop both talk
+// to it, so every entry point that touches GSheet holds this lock.
 
-void ensureWiFi() {
-  if (WiFi.status() == WL_CONNECTED) return;
-  
-  Serial.println("Attempting WiFi connection...");
-  WiFi.begin(WIFI_SSID, WIFI_PASS);
-  unsigned long start = millis();
+static SemaphoreHandle_t s_sheetsLock = xSemaphoreCreateRecursiveMutex();
 
-  configTime(0, 0, "pool.ntp.org");
-  delay(1000);
+struct SheetsLock {
+  SheetsLock()  { xSemaphoreTakeRecursive(s_sheetsLock, portMAX_DELAY); }
+  ~SheetsLock() { xSemaphoreGiveRecursive(s_sheetsLock); }
+};
 
-  time_t now;
-  struct tm timeinfo;
-  if (getLocalTime(&timeinfo)) {
-    time(&now);
-    GSheet.setSystemTime(now);
-    Serial.println("✅ System time set for GSheet");
-  } else {
-    Serial.println("⚠️ Failed to obtain time from NTP");
+// ===================== CIRCUIT BREAKER ==============================
+// Consecutive request failures open the breaker; while open every Sheets
+// entry point fails fast and writes just stay queued. After an
+// exponentially growing, jittered delay the next request is let through
+// as a probe: success closes the breaker, failure re-opens it for longer.
+// All requests are serialized by SheetsLock, so only one probe is ever in
+// flight, and the breaker fields below are only touched under it.
+
+enum BreakerState : uint8_t {
+  BREAKER_CLOSED = 0,        // Normal operation
+  BREAKER_OPEN = 1,          // Failing fast until s_breakerOpenedAt + s_breakerDelay
+  BREAKER_HALF_OPEN = 2      // Next request is the probe
+};
+
+static volatile BreakerState s_breakerState = BREAKER_CLOSED;
+static uint8_t s_breakerFailures = 0;       // Consecutive failed requests
+static uint8_t s_breakerTrips = 0;          // Opens since last success (backoff exponent)
+static unsigned long s_breakerOpenedAt = 0;
+static unsigned long s_breakerDelay = 0;
+static volatile bool s_probeRequested = false;   // Set by probeBreakerNow() off the lock
+
+// True if a Sheets request may be issued now. Caller holds SheetsLock.
+static bool breakerAllows() {
+  if (s_probeRequested) {
+    s_probeRequested = false;
+    if (s_breakerState == BREAKER_OPEN) s_breakerDelay = 0;
+  }
+  if (s_breakerState == BREAKER_OPEN && millis() - s_breakerOpenedAt >= s_breakerDelay) {
+    s_breakerState = BREAKER_HALF_OPEN;
+    Serial.println("Sheets breaker half-open: probing");
   }
+  return s_breakerState != BREAKER_OPEN;
+}
 
-  GSheet.setTokenCallback(tokenStatusCallback);
-  GSheet.setPrerefreshSeconds(10 * 60);
-  GSheet.begin(CLIENT_EMAIL, PROJECT_ID, PRIVATE_KEY);
-  
-  while (millis() - start < 10000) {
-    if (WiFi.status() == WL_CONNECTED) {
-      Serial.println("WiFi connected!");
-      return;
-    }
-    delay(200);
+static void openBreaker() {
+  unsigned long backoff = SHEETS_BACKOFF_BASE_MS;
+  for (uint8_t i = 0; i < s_breakerTrips && backoff < SHEETS_BACKOFF_MAX_MS; ++i) backoff *= 2;
+  if (backoff > SHEETS_BACKOFF_MAX_MS) backoff = SHEETS_BACKOFF_MAX_MS;
+  // Up to +25% jitter so a fleet doesn't retry in lockstep
+  backoff += random(0, backoff / 4 + 1);
+
+  if (s_breakerTrips < 255) ++s_breakerTrips;
+  s_breakerState = BREAKER_OPEN;
+  s_breakerOpenedAt = millis();
+  s_breakerDelay = backoff;
+  Serial.print("Sheets breaker open for ");
+  Serial.print(backoff);
+  Serial.println(" ms");
+}
+
+// Report the outcome of one Sheets request
+static void recordSheetsResult(bool ok) {
+  if (ok) {
+    if (s_breakerState != BREAKER_CLOSED) Serial.println("Sheets breaker closed");
+    s_breakerState = BREAKER_CLOSED;
+    s_breakerFailures = 0;
+    s_breakerTrips = 0;
+    return;
+  }
+  if (s_breakerFailures < 255) ++s_breakerFailures;
+  if (s_breakerState == BREAKER_HALF_OPEN || s_breakerFailures >= SHEETS_BREAKER_THRESHOLD) {
+    openBreaker();
   }
-  
-  Serial.println("WiFi connection failed");
-  g_registry.logError(ERR_SHEETS_SYNC, "WiFi connection failed", "");
 }
 
-bool isWiFiConnected() {
-  return WiFi.status() == WL_CONNECTED;
+// A fresh connection is worth probing without waiting out the backoff.
+// Called from loop(), which must not wait on SheetsLock behind a request,
+// so it only leaves a flag for the next breakerAllows() to act on.
+static void probeBreakerNow() {
+  s_probeRequested = true;
 }
 
-// ===================== DATABASE SYNCHRONIZATION ====================
+// ===================== OUTBOUND WRITE QUEUE ========================
+// Writes accumulate here and are flushed in batches by the writer task:
+// one multi-row append per sheet plus one batchUpdate for stock cells.
+// Transactions rows are not queued: they are uploaded from the ledger.
 
-void syncProductDataFromSheets() {
-  // Fetch all product data from Google Sheets using service-account
-  ensureWiFi();
-  if (!isWiFiConnected()) {
-    g_registry.logError(ERR_SHEETS_SYNC, "WiFi not connected", "");
-    return;
+enum SheetsWriteType : uint8_t {
+  WRITE_STOCK = 0,           // Stock cell in Products sheet
+  WRITE_ERROR = 1,           // Row in Errors sheet
+  WRITE_MODULE = 2           // Row in Modules sheet
+};
+
+struct SheetsWrite {
+  uint32_t id;               // Enqueue order; a coalesced update gets a new id
+  SheetsWriteType type;
+  String key;                // Item code, error message or module UID
+  String detail;             // Error details (errors only)
+  int value;                 // New stock or I2C address
+  String timestamp;          // Captured at enqueue time
+  uint8_t attempts;          // Failed sends so far
+};
+
+static std::vector<SheetsWrite> s_writeQueue;
+static uint32_t s_nextWriteId = 1;
+static SemaphoreHandle_t s_queueLock = xSemaphoreCreateMutex();
+static TaskHandle_t s_sheetsTask = nullptr;
+
+static bool enqueueWrite(SheetsWriteType type, const String& key, int value, const String& detail = "") {
+  xSemaphoreTake(s_queueLock, portMAX_DELAY);
+  bool ok = true;
+  bool coalesced = false;
+
+  // Only the latest stock value per item code matters
+  if (type == WRITE_STOCK) {
+    for (auto &w : s_writeQueue) {
+      if (w.type == WRITE_STOCK && w.key == key) {
+        w.value = value;
+        w.id = s_nextWriteId++;
+        w.attempts = 0;
+        coalesced = true;
+        break;
+      }
+    }
   }
 
-  // Wait for GSheet to be ready (token acquired)
-  unsigned long start = millis();
-  while (!GSheet.ready() && millis() - start < 10000) {
-    delay(50);
+  if (!coalesced) {
+    ok = s_writeQueue.size() < SHEETS_QUEUE_CAPACITY;
+    if (ok) {
+      if (s_writeQueue.capacity() < SHEETS_QUEUE_CAPACITY) s_writeQueue.reserve(SHEETS_QUEUE_CAPACITY);
+      SheetsWrite w;
+      w.id =        s_nextWriteId++;
+      w.type =      type;
+      w.key =       key;
+      w.detail =    detail;
+      w.value =     value;
+      w.timestamp = (type == WRITE_ERROR) ? getNtpTimeString() : String("");
+      w.attempts =  0;
+      s_writeQueue.push_back(w);
+    }
   }
+  xSemaphoreGive(s_queueLock);
 
-  String resp;
-  String range = "Products!A2:D"; // A: code, B: name, C: stock, D: i2c address
-  bool ok = GSheet.values.get(&resp, spreadsheetId, range.c_str());
   if (!ok) {
-    Serial.println("GSheet: failed to read Products range: ");
-    Serial.println(GSheet.errorReason());
-    g_registry.logError(ERR_SHEETS_SYNC, "GSheet read failed", GSheet.errorReason());
-    return;
+    Serial.println("Sheets write queue full; dropping write");
+    g_registry->logError(ERR_SHEETS_SYNC, "Sheets write queue full", key.c_str());
+    return false;
   }
+  if (s_sheetsTask) xTaskNotifyGive(s_sheetsTask);
+  return true;
+}
+
+// Copy the current queue contents into `out`. Returns the highest id
+// copied, which bounds what settleWrites() may remove afterwards.
+static uint32_t snapshotWrites(std::vector<SheetsWrite> &out) {
+  xSemaphoreTake(s_queueLock, portMAX_DELAY);
+  out = s_writeQueue;
+  uint32_t lastId = s_nextWriteId - 1;
+  xSemaphoreGive(s_queueLock);
+  return lastId;
+}
+
+// Resolve every queued write of `type` with id <= lastId: remove it if
+// `sent`, otherwise count the failure and drop it after max attempts.
+static void settleWrites(SheetsWriteType type, uint32_t lastId, bool sent) {
+  size_t dropped = 0;
+  xSemaphoreTake(s_queueLock, portMAX_DELAY);
+  size_t keep = 0;
+  for (size_t i = 0; i < s_writeQueue.size(); ++i) {
+    SheetsWrite &w = s_writeQueue[i];
+    bool remove = false;
+    if (w.type == type && w.id <= lastId) {
+      if (sent) {
+        remove = true;
+      } else if (++w.attempts >= SHEETS_MAX_ATTEMPTS) {
+        remove = true;
+        ++dropped;
+      }
+    }
+    if (!remove) {
+      if (keep != i) s_writeQueue[keep] = s_writeQueue[i];
+      ++keep;
+    }
+  }
+  s_writeQueue.resize(keep);
+  xSemaphoreGive(s_queueLock);
+
+  if (dropped > 0) {
+    Serial.print("Sheets writes dropped after max attempts: ");
+    Serial.println((int)dropped);
+    char count[12];
+    utoa((unsigned)dropped, count, 10);
+    g_registry->logError(ERR_SHEETS_SYNC, "Sheets writes dropped", count);
+  }
+}
+
+bool pendingStockFor(const String& itemCode, int &outStock) {
+  bool found = false;
+  xSemaphoreTake(s_queueLock, portMAX_DELAY);
+  for (auto &w : s_writeQueue) {
+    if (w.type == WRITE_STOCK && w.key == itemCode) {
+      outStock = w.value;
+      found = true;
+      break;
+    }
+  }
+  xSemaphoreGive(s_queueLock);
+  return found;
+}
+
+// ===================== STREAMING READS ============================
+// Ranges are read straight from the REST API with the GSheet access token
+// so the body can be parsed as it arrives: GSheet.values.get() would
+// buffer the whole response first. Peak memory is one chunk plus one row.
+// Guarded by SheetsLock (the chunk buffer is shared).
 
-  std::vector<std::vector<String>> rows;
-  parseValuesJson(resp, rows);
+static char s_streamBuf[SHEETS_STREAM_CHUNK];
+static String s_readError;
 
-  Serial.println("Parsing Products sheet rows...");
-  for (size_t i = 0; i < rows.size(); ++i) {
-    auto &r = rows[i];
-    if (r.size() < 1) continue; // skip empty rows
+static String valuesUrl(const char *range) {
+  String url = "https://sheets.googleapis.com/v4/spreadsheets/";
+  url += spreadsheetId;
+  url += "/values/";
+  url += range;
+  return url;
+}
 
-    String code = r.size() > 0 ? r[0] : String("");
-    String name = r.size() > 1 ? r[1] : String("");
-    int stock = r.size() > 2 ? r[2].toInt() : 0;
-    String addrStr = r.size() > 3 ? r[3] : String("");
+static String batchGetUrl(const char *range1, const char *range2) {
+  String url = "https://sheets.googleapis.com/v4/spreadsheets/";
+  url += spreadsheetId;
+  url += "/values:batchGet?ranges=";
+  url += range1;
+  url += "&ranges=";
+  url += range2;
+  return url;
+}
 
-    code.trim(); name.trim(); addrStr.trim();
+// GET `url` and feed the body through `parser` chunk by chunk
+static bool streamSheetsGet(const String &url, SheetsValuesParser &parser) {
+  String token = GSheet.accessToken();
+  if (token.length() == 0) {
+    s_readError = "no access token";
+    return false;
+  }
 
-    // Always add or update the product in the local registry
-    g_registry.addProduct(code, name, stock, true);
+  WiFiClientSecure client;
+  client.setInsecure();   // Same trust model as the GSheet client (no CA pinned)
+  HTTPClient http;
+  http.useHTTP10(true);   // No chunked transfer encoding: the stream is the raw body
+  http.setTimeout(SHEETS_HTTP_TIMEOUT_MS);
+  if (!http.begin(client, url)) {
+    s_readError = "HTTP begin failed";
+    recordSheetsResult(false);
+    return false;
+  }
+  http.addHeader("Authorization", "Bearer " + token);
+
+  int status = http.GET();
+  if (status != HTTP_CODE_OK) {
+    s_readError = status > 0 ? "HTTP " + String(status) : http.errorToString(status);
+    // Transport errors, throttling and server errors mean the service is
+    // unavailable; other 4xx are request problems
+    recordSheetsResult(status > 0 && status < 500 && status != 429);
+    http.end();
+    return false;
+  }
 
-    // If the sheet row contains an I2C address, try to map product -> module
-    if (addrStr.length() > 0) {
-      // Accept decimal or 0x-prefixed hex. Use strtol base=0 to support both.
-      char *endptr = nullptr;
-      long addrVal = strtol(addrStr.c_str(), &endptr, 0);
-      if (endptr == addrStr.c_str()) {
-        Serial.print("Products: invalid address for code "); Serial.print(code); Serial.print(" -> '"); Serial.print(addrStr); Serial.println("'");
-        continue;
+  recordSheetsResult(true);
+
+  WiFiClient *stream = http.getStreamPtr();
+  int remaining = http.getSize();   // -1 if the server sent no length
+  size_t fill = 0;
+  bool ok = true;
+  unsigned long lastData = millis();
+
+  while (remaining != 0) {
+    int avail = stream->available();
+    if (avail <= 0) {
+      if (!stream->connected()) break;
+      if (millis() - lastData > SHEETS_HTTP_TIMEOUT_MS) {
+        s_readError = "read timeout";
+        recordSheetsResult(false);
+        http.end();
+        return false;
       }
+      delay(1);
+      continue;
+    }
+
+    size_t want = sizeof(s_streamBuf) - fill;
+    if (remaining > 0 && (size_t)remaining < want) want = remaining;
+    if ((size_t)avail < want) want = avail;
+    size_t n = stream->readBytes(s_streamBuf + fill, want);
+    lastData = millis();
+    if (remaining > 0) remaining -= n;
+    fill += n;
+
+    // Rows are applied as they complete; keep only the unfinished tail
+    size_t consumed = parser.parse(s_streamBuf, fill);
+    if (parser.failed()) {
+      s_readError = "malformed response";
+      ok = false;
+      break;
+    }
+    if (consumed == 0 && fill == sizeof(s_streamBuf)) {
+      s_readError = "row larger than stream buffer";
+      ok = false;
+      break;
+    }
+    memmove(s_streamBuf, s_streamBuf + consumed, fill - consumed);
+    fill -= consumed;
+  }
+
+  // A dropped connection ends the loop like a finished body does; only a
+  // closed document with nothing left over and nothing still owed counts
+  if (ok && (!parser.complete() || fill != 0 || remaining > 0)) {
+    s_readError = "truncated response";
+    recordSheetsResult(false);
+    ok = false;
+  }
+
+  http.end();
+  return ok;
+}
+
+// Stream one range through `onRow`. Caller holds SheetsLock.
+static bool readSheetRange(const char *range, SheetsRowCallback onRow, void *ctx) {
+  SheetsValuesParser parser(onRow, ctx);
+  return streamSheetsGet(valuesUrl(range), parser);
+}
+
+// ===================== PRODUCT ROW INDEX ==========================
+// itemCode -> sheet row in Products, recorded during sync so a stock
+// update is a single targeted write. Fixed tables keyed by
+// HashIndex::hashOf(itemCode), so rebuilding one allocates nothing. Two
+// codes sharing a hash would share a row, but sendStockBatch() checks the
+// code each write landed on. Guarded by SheetsLock.
+
+struct ProductRowSlot {
+  uint32_t hash;
+  uint16_t row;
+};
+
+struct ProductRows {
+  ProductRowSlot slots[REGISTRY_MAX_PRODUCTS];
+  uint16_t count;
+};
+
+static ProductRows s_productRows;           // Live index
+static ProductRows s_pendingRows;           // Being rebuilt by a sync or refresh
+static bool s_productRowsValid = false;
+
+// Later rows win, as for a code listed twice in the sheet
+static void putProductRow(ProductRows &rows, const char *code, uint16_t row) {
+  if (rows.count >= REGISTRY_MAX_PRODUCTS) return;
+  rows.slots[rows.count].hash = HashIndex::hashOf(code);
+  rows.slots[rows.count].row = row;
+  ++rows.count;
+}
+
+static bool findProductRow(const ProductRows &rows, uint32_t hash, uint16_t &row) {
+  for (uint16_t i = rows.count; i-- > 0;) {
+    if (rows.slots[i].hash != hash) continue;
+    row = rows.slots[i].row;
+    return true;
+  }
+  return false;
+}
 
-      uint8_t addr = (uint8_t)(addrVal & 0xFF);
-      ProductModule* mod = g_registry.findModuleByAddress(addr);
-      if (mod) {
-        // Module is already discovered locally; assign product info
-        mod->itemCode = code;
-        mod->name = name;
-        mod->stock = stock;
-      } else {
-        // Module not present yet in registry; create a placeholder module entry
-        // UID unknown here (module may not have been scanned), store empty UID.
-        g_registry.addModule(addr, String(""), code, name, stock);
+static void invalidateProductRows(const char *reason) {
+  if (!s_productRowsValid) return;
+  Serial.print("Product row index invalidated: ");
+  Serial.println(reason);
+  s_productRows.count = 0;
+  s_productRowsValid = false;
+}
+
+// Replace the index with s_pendingRows, noting if any known code changed row
+static void replaceProductRows() {
+  if (s_productRowsValid) {
+    for (uint16_t i = 0; i < s_pendingRows.count; ++i) {
+      uint16_t old;
+      const ProductRowSlot &slot = s_pendingRows.slots[i];
+      if (findProductRow(s_productRows, slot.hash, old) && old != slot.row) {
+        Serial.println("Products sheet reordered; row index rebuilt");
+        break;
       }
     }
   }
+  memcpy(s_productRows.slots, s_pendingRows.slots, s_pendingRows.count * sizeof(ProductRowSlot));
+  s_productRows.count = s_pendingRows.count;
+  s_productRowsValid = true;
+}
 
-  Serial.println("Product data synced from Google Sheets (service-account)");
-  g_registry.debugPrintProducts();
+// Row callback: record itemCode -> sheet row into the ProductRows at `ctx`
+static void indexProductRow(const SheetsRow &row, void *ctx) {
+  char code[ITEM_CODE_LEN + 1];
+  row.cell(0).trimmed().copyTo(code, sizeof(code));
+  if (!code[0]) return;
+  // row index i corresponds to sheet row (i + 2)
+  putProductRow(*static_cast<ProductRows*>(ctx), code, (uint16_t)(row.index + 2));
+}
 
-  // --- Also load Modules mapping into registry (Modules!A2:C -> UID, Address, ProductCode)
-  String respMod;
-  bool ok2 = GSheet.values.get(&respMod, spreadsheetId, "Modules!A2:C");
-  if (!ok2) {
-    Serial.println("GSheet: failed to read Modules range: ");
-    Serial.println(GSheet.errorReason());
-    // don't treat this as fatal; registry still has products
-  } else {
-    std::vector<std::vector<String>> modRows;
-    parseValuesJson(respMod, modRows);
-    Serial.println("Parsing Modules sheet rows...");
-    for (size_t i = 0; i < modRows.size(); ++i) {
-      auto &mr = modRows[i];
-      if (mr.size() < 1) continue;
-      String uid = mr.size() > 0 ? mr[0] : String("");
-      String addrStr = mr.size() > 1 ? mr[1] : String("");
-      String code = mr.size() > 2 ? mr[2] : String("");
-      uid.trim(); addrStr.trim(); code.trim();
-
-      uint8_t addr = 0;
-      if (addrStr.length() > 0) {
-        char *endptr = nullptr;
-        long v = strtol(addrStr.c_str(), &endptr, 0);
-        if (endptr != addrStr.c_str()) {
-          addr = (uint8_t)(v & 0xFF);
-        } else {
-          Serial.print("Modules: invalid address for UID "); Serial.print(uid); Serial.print(" -> '"); Serial.print(addrStr); Serial.println("'");
-        }
+// Fallback when no sync has populated the index: read only column A
+static bool refreshProductRowsFromSheet() {
+  s_pendingRows.count = 0;
+  if (!readSheetRange("Products!A2:A", indexProductRow, &s_pendingRows)) {
+    Serial.print("GSheet read failed for product rows: ");
+    Serial.println(s_readError);
+    g_registry->logError(ERR_SHEETS_SYNC, "read for product rows failed", s_readError.c_str());
+    return false;
+  }
+  replaceProductRows();
+  return true;
+}
+
+// ===================== WIFI CONNECTIVITY ============================
+// WiFi association and NTP are advanced one non-blocking step per
+// tickConnection() call from loop(). Token acquisition happens inside
+// GSheet.ready(), which can block for a TLS round-trip, so that step is
+// polled from the Sheets task instead (pollSheetsAuth()).
+
+static volatile ConnState s_connState = CONN_IDLE;
+static volatile bool s_authReady = false;
+static unsigned long s_connStepAt = 0;      // When the current step started
+static bool s_gsheetBegun = false;
+
+static void enterConnState(ConnState next) {
+  s_connState = next;
+  s_connStepAt = millis();
+}
+
+void tickConnection() {
+  unsigned long now = millis();
+  bool linkUp = WiFi.status() == WL_CONNECTED;
+
+  // Lost the link after association: wait for it to come back
+  if (!linkUp && s_connState > CONN_WIFI_WAIT) {
+    Serial.println("WiFi connection lost");
+    s_authReady = false;
+    WiFi.reconnect();
+    enterConnState(CONN_WIFI_WAIT);
+    return;
+  }
+
+  switch (s_connState) {
+    case CONN_IDLE:
+      Serial.println("Attempting WiFi connection...");
+      WiFi.mode(WIFI_STA);
+      WiFi.begin(WIFI_SSID, WIFI_PASS);
+      enterConnState(CONN_WIFI_WAIT);
+      break;
+
+    case CONN_WIFI_WAIT:
+      if (linkUp) {
+        Serial.println("WiFi connected!");
+        configTime(0, 0, "pool.ntp.org");   // SNTP runs in the background
+        enterConnState(CONN_NTP_WAIT);
+      } else if (now - s_connStepAt > WIFI_CONNECT_TIMEOUT_MS) {
+        Serial.println("WiFi connection failed");
+        ProductRegistry::logError(ERR_SHEETS_SYNC, "WiFi connection failed", "");
+        enterConnState(CONN_BACKOFF);
       }
+      break;
 
-      // If a module at this address already exists, update its UID/code
-      ProductModule* existing = g_registry.findModuleByAddress(addr);
-      if (existing) {
-        if (uid.length() > 0) existing->moduleUID = uid;
-        if (code.length() > 0) existing->itemCode = code;
-      } else {
-        // Add module with the information from the sheet
-        g_registry.addModule(addr, uid, code, String(""), 0);
+    case CONN_NTP_WAIT: {
+      time_t t = time(nullptr);
+      if (t > 1000000000) {
+        GSheet.setSystemTime(t);
+        Serial.println("✅ System time set for GSheet");
+        if (!s_gsheetBegun) {
+          GSheet.setTokenCallback(tokenStatusCallback);
+          GSheet.setPrerefreshSeconds(10 * 60);
+          GSheet.begin(CLIENT_EMAIL, PROJECT_ID, PRIVATE_KEY);
+          s_gsheetBegun = true;
+        }
+        probeBreakerNow();
+        enterConnState(CONN_ONLINE);
+      } else if (now - s_connStepAt > NTP_SYNC_TIMEOUT_MS) {
+        Serial.println("⚠️ Failed to obtain time from NTP; retrying");
+        configTime(0, 0, "pool.ntp.org");
+        enterConnState(CONN_NTP_WAIT);
       }
+      break;
     }
 
-    Serial.println("Module mapping synced from Google Sheets");
-    g_registry.debugPrintModules();
+    case CONN_BACKOFF:
+      if (now - s_connStepAt > WIFI_RETRY_MS) {
+        WiFi.disconnect();
+        WiFi.begin(WIFI_SSID, WIFI_PASS);
+        enterConnState(CONN_WIFI_WAIT);
+      }
+      break;
+
+    case CONN_ONLINE:
+      break;
+  }
+}
+
+// Sheets task only: drive GSheet token acquisition/refresh
+static void pollSheetsAuth() {
+  if (s_connState != CONN_ONLINE) {
+    s_authReady = false;
+    return;
   }
+  SheetsLock lock;
+  s_authReady = GSheet.ready();
 }
 
-void logTransactionToSheets(const String& itemCode, int amount) {
-  // Append a row to Transactions sheet: timestamp, itemCode, amount
-  ensureWiFi();
-  if (!isWiFiConnected()) return;
+ConnState connectionState() {
+  return s_connState;
+}
 
+bool isWiFiConnected() {
+  return WiFi.status() == WL_CONNECTED;
+}
+
+bool isSheetsReady() {
+  return s_connState == CONN_ONLINE && s_authReady;
+}
+
+bool waitForSheetsReady(unsigned long timeoutMs) {
   unsigned long start = millis();
-  while (!GSheet.ready() && millis() - start < 10000) delay(10);
+  while (!isSheetsReady() && millis() - start < timeoutMs) {
+    tickConnection();
+    delay(50);
+  }
+  return isSheetsReady();
+}
 
-  FirebaseJson valueRange;
-  valueRange.add("range", "Transactions!A:C");
-  valueRange.add("majorDimension", "ROWS");
-  valueRange.set("values/[0]/[0]", getNtpTimeString());
-  valueRange.set("values/[0]/[1]", itemCode);
-  valueRange.set("values/[0]/[2]", String(amount));
+// ===================== DATABASE SYNCHRONIZATION ====================
 
-  FirebaseJson response;
-  bool ok = GSheet.values.append(&response, spreadsheetId, "Transactions!A:C", &valueRange, "USER_ENTERED", "INSERT_ROWS", "true");
-  if (!ok) {
-    Serial.print("GSheet append transaction failed: ");
-    Serial.println(GSheet.errorReason());
-    g_registry.logError(ERR_SHEETS_SYNC, "Transaction append failed", GSheet.errorReason());
+// Sync target and the itemCode -> sheet row index being rebuilt
+struct SyncContext {
+  ProductRegistry *reg;
+  ProductRows *rows;
+};
+
+// Products!A2:D row -> registry (A: code, B: name, C: stock, D: i2c address)
+static void applyProductRow(const SheetsRow &r, SyncContext &sync) {
+  if (r.count < 1) return; // skip empty rows
+  ProductRegistry &reg = *sync.reg;
+
+  // Fixed buffers: the registry and the row index copy what they keep,
+  // nothing is heap
+  char code[ITEM_CODE_LEN + 1];
+  char name[256];
+  r.cell(0).trimmed().copyTo(code, sizeof(code));
+  r.cell(1).trimmed().copyTo(name, sizeof(name));
+  int stock = (int)r.cell(2).toLong(0);
+  CellView addrCell = r.cell(3).trimmed();
+
+  // row index i corresponds to sheet row (i + 2)
+  if (code[0]) putProductRow(*sync.rows, code, (uint16_t)(r.index + 2));
+
+  // Always add or update the product in the local registry
+  reg.addProduct(code, name, stock, true);
+
+  // If the sheet row contains an I2C address, try to map product -> module
+  if (!addrCell.empty()) {
+    uint8_t addr;
+    if (!addrCell.toAddress(addr)) {
+      Serial.print("Products: invalid address for code "); Serial.print(code); Serial.print(" -> '"); Serial.print(addrCell.toString()); Serial.println("'");
+      return;
+    }
+
+    ProductModule* mod = reg.findModuleByAddress(addr);
+    if (mod) {
+      // Module is already discovered locally; assign product info
+      reg.setModuleCode(mod, code);
+      mod->stock = stock;
+    } else {
+      // Module not present yet in registry; create a placeholder module entry
+      // UID unknown here (module may not have been scanned), store empty UID.
+      reg.addModule(addr, "", code, stock);
+    }
+  }
+}
+
+// Modules!A2:C row -> registry (A: UID, B: address, C: product code)
+static void applyModuleRow(const SheetsRow &r, SyncContext &sync) {
+  if (r.count < 1) return;
+  ProductRegistry &reg = *sync.reg;
+  char uid[MODULE_UID_LEN + 1];
+  char code[ITEM_CODE_LEN + 1];
+  r.cell(0).trimmed().copyTo(uid, sizeof(uid));
+  r.cell(2).trimmed().copyTo(code, sizeof(code));
+  CellView addrCell = r.cell(1).trimmed();
+
+  uint8_t addr = 0;
+  if (!addrCell.empty() && !addrCell.toAddress(addr)) {
+    Serial.print("Modules: invalid address for UID "); Serial.print(uid); Serial.print(" -> '"); Serial.print(addrCell.toString()); Serial.println("'");
+  }
+
+  // If a module at this address already exists, update its UID/code
+  ProductModule* existing = reg.findModuleByAddress(addr);
+  if (existing) {
+    if (uid[0]) reg.setModuleUID(existing, uid);
+    if (code[0]) reg.setModuleCode(existing, code);
   } else {
-    Serial.println("Transaction appended to Google Sheets");
+    // Add module with the information from the sheet
+    reg.addModule(addr, uid, code, 0);
   }
 }
 
-void updateStockInSheets(const String& itemCode, int newStock) {
-  // Find the product row in Products sheet and update column C
-  ensureWiFi();
-  if (!isWiFiConnected()) return;
+// batchGet row dispatcher; `ctx` is the SyncContext
+static void applySyncRow(const SheetsRow &r, void *ctx) {
+  SyncContext &sync = *static_cast<SyncContext*>(ctx);
+  if (r.range == 0) applyProductRow(r, sync);
+  else if (r.range == 1) applyModuleRow(r, sync);
+}
 
-  unsigned long start = millis();
-  while (!GSheet.ready() && millis() - start < 10000) delay(10);
+enum SnapshotState : uint8_t {
+  SNAPSHOT_IDLE = 0,         // Back buffer free
+  SNAPSHOT_BUILDING = 1,     // A sync is filling the back buffer
+  SNAPSHOT_READY = 2         // Back buffer holds an unpublished sync
+};
 
-  String range = "Products!A2:D";
-  String resp;
-  bool ok = GSheet.values.get(&resp, spreadsheetId, range.c_str());
-  if (!ok) {
-    Serial.print("GSheet read failed for updateStock: ");
-    Serial.println(GSheet.errorReason());
-    g_registry.logError(ERR_SHEETS_SYNC, "read for updateStock failed", GSheet.errorReason());
-    return;
+static volatile SnapshotState s_snapshotState = SNAPSHOT_IDLE;
+static volatile bool s_syncRequested = false;
+
+// Apply stock values still waiting in the write queue: they are newer
+// than what the sheet returned
+static void overlayPendingStock(ProductRegistry &reg) {
+  xSemaphoreTake(s_queueLock, portMAX_DELAY);
+  for (auto &w : s_writeQueue) {
+    if (w.type != WRITE_STOCK) continue;
+    ProductItem *p = reg.findProduct(w.key);
+    if (p) p->stock = w.value;
   }
+  xSemaphoreGive(s_queueLock);
+}
 
-  std::vector<std::vector<String>> rows;
-  parseValuesJson(resp, rows);
-
-  for (size_t i = 0; i < rows.size(); ++i) {
-    if (rows[i].size() < 1) continue;
-    if (rows[i][0] == itemCode) {
-      // row index i corresponds to sheet row (i + 2)
-      String target = "Products!C";
-      target += String(i + 2);
-      FirebaseJson valueRange;
-      valueRange.add("range", target);
-      valueRange.add("majorDimension", "ROWS");
-      valueRange.set("values/[0]/[0]", String(newStock));
-
-      FirebaseJson response;
-      bool ok2 = GSheet.values.update(&response, spreadsheetId, target.c_str(), &valueRange);
-      if (!ok2) {
-        Serial.print("GSheet update failed: ");
-        Serial.println(GSheet.errorReason());
-        g_registry.logError(ERR_SHEETS_SYNC, "updateStock failed", GSheet.errorReason());
-      } else {
-        Serial.println("Products sheet stock updated");
-      }
-      return;
-    }
+// Fetch all product data from Google Sheets into `target`, which starts
+// empty. Returns true if at least the Products range was read. Caller
+// holds SheetsLock.
+static bool syncInto(ProductRegistry &target) {
+  // Fetch all product data from Google Sheets using service-account
+  if (!isSheetsReady()) {
+    ProductRegistry::logError(ERR_SHEETS_SYNC, "Sheets not connected", "");
+    return false;
+  }
+  if (!breakerAllows()) {
+    Serial.println("Sheets sync skipped: breaker open");
+    return false;
   }
 
-  Serial.println("Product code not found in sheet when updating stock");
+  // Products and Modules come back in one values:batchGet response; rows
+  // are applied to the registry while it is still arriving.
+  //   range 0 = Products!A2:D (A: code, B: name, C: stock, D: i2c address)
+  //   range 1 = Modules!A2:C  (A: UID, B: address, C: product code)
+  target.clearRegistry();
+  target.beginCatalog(*g_registry);
+  SyncContext sync;
+  sync.reg = &target;
+  sync.rows = &s_pendingRows;
+  s_pendingRows.count = 0;
+  SheetsValuesParser parser(applySyncRow, &sync);
+  Serial.println("Streaming Products + Modules sheet rows...");
+  bool ok = streamSheetsGet(batchGetUrl("Products!A2:D", "Modules!A2:C"), parser);
+
+  // Products are complete once the Modules range has started
+  if (!ok && parser.rangesSeen() < 2) {
+    Serial.println("GSheet: failed to read Products range: ");
+    Serial.println(s_readError);
+    ProductRegistry::logError(ERR_SHEETS_SYNC, "GSheet read failed", s_readError.c_str());
+    return false;
+  }
+
+  // Codes and names go to flash only now, and only if they changed
+  if (!target.commitCatalog()) {
+    ProductRegistry::logError(ERR_SHEETS_SYNC, "Catalog image write failed", "");
+    return false;
+  }
+
+  replaceProductRows();
+
+  // Stock still waiting to be written is newer than what the sheet
+  // returned, whether or not the Modules range made it
+  overlayPendingStock(target);
+
+  Serial.println("Product data synced from Google Sheets (service-account)");
+  target.debugPrintProducts();
+
+  if (!ok) {
+    Serial.println("GSheet: failed to read Modules range: ");
+    Serial.println(s_readError);
+    // don't treat this as fatal; registry still has products
+  } else {
+    Serial.println("Module mapping synced from Google Sheets");
+    target.debugPrintModules();
+
+    // Persist the complete catalog for the next warm boot
+    target.saveSnapshot();
+  }
+  return true;
 }
 
-void logErrorToSheets(const String& errorMsg, const String& errorDetails) {
-  // Append an error row to Errors sheet: timestamp, message, details
-  ensureWiFi();
-  if (!isWiFiConnected()) return;
+void syncProductDataFromSheets() {
+  SheetsLock lock;   // Also waits out a background build
+  s_snapshotState = SNAPSHOT_BUILDING;
+  bool ok = syncInto(backRegistry());
+  s_snapshotState = ok ? SNAPSHOT_READY : SNAPSHOT_IDLE;
+  publishSheetsSync();
+}
 
-  unsigned long start = millis();
-  while (!GSheet.ready() && millis() - start < 10000) delay(10);
+void requestSheetsSync() {
+  s_syncRequested = true;
+  if (s_sheetsTask) xTaskNotifyGive(s_sheetsTask);
+}
 
+bool publishSheetsSync() {
+  if (s_snapshotState != SNAPSHOT_READY) return false;
+
+  ProductRegistry &next = backRegistry();
+  // Pending sales first, so they don't read as changes against the
+  // active registry (which already has them)
+  overlayPendingStock(next);
+  next.adoptRuntimeState(*g_registry);
+  swapRegistries();
+  s_snapshotState = SNAPSHOT_IDLE;
+  // Stock writes held back while the snapshot waited can go out now
+  if (s_sheetsTask) xTaskNotifyGive(s_sheetsTask);
+  return true;
+}
+
+// Runs on the Sheets task. Skipped while a finished sync awaits publish.
+static void buildSnapshot() {
+  SheetsLock lock;
+  if (s_snapshotState != SNAPSHOT_IDLE) return;
+  s_snapshotState = SNAPSHOT_BUILDING;
+  bool ok = syncInto(backRegistry());
+  s_snapshotState = ok ? SNAPSHOT_READY : SNAPSHOT_IDLE;
+}
+
+// Append every queued write of `type` to `range` as one multi-row
+// append. Returns true if there was nothing to send or the send worked.
+static bool appendBatch(const std::vector<SheetsWrite> &batch, SheetsWriteType type, const char *range) {
   FirebaseJson valueRange;
-  valueRange.add("range", "Errors!A:C");
+  valueRange.add("range", range);
   valueRange.add("majorDimension", "ROWS");
-  valueRange.set("values/[0]/[0]", getNtpTimeString());
-  valueRange.set("values/[0]/[1]", errorMsg);
-  valueRange.set("values/[0]/[2]", errorDetails);
+
+  size_t row = 0;
+  for (auto &w : batch) {
+    if (w.type != type) continue;
+    String base = "values/[" + String((int)row) + "]/";
+    switch (type) {
+      case WRITE_ERROR:
+        // timestamp, message, details
+        valueRange.set(base + "[0]", w.timestamp);
+        valueRange.set(base + "[1]", w.key);
+        valueRange.set(base + "[2]", w.detail);
+        break;
+      case WRITE_MODULE:
+        // uid, address
+        valueRange.set(base + "[0]", w.key);
+        valueRange.set(base + "[1]", String(w.value));
+        break;
+      default:
+        break;
+    }
+    ++row;
+  }
+  if (row == 0) return true;
 
   FirebaseJson response;
-  bool ok = GSheet.values.append(&response, spreadsheetId, "Errors!A:C", &valueRange, "USER_ENTERED", "INSERT_ROWS", "true");
+  bool ok = GSheet.values.append(&response, spreadsheetId, range, &valueRange, "USER_ENTERED", "INSERT_ROWS", "true");
+  recordSheetsResult(ok);
   if (!ok) {
-    Serial.print("GSheet append error log failed: ");
+    Serial.print("GSheet append failed for ");
+    Serial.print(range);
+    Serial.print(": ");
     Serial.println(GSheet.errorReason());
+    g_registry->logError(ERR_SHEETS_SYNC, "Batch append failed", GSheet.errorReason().c_str());
+    return false;
   }
+  Serial.print("Appended ");
+  Serial.print((int)row);
+  Serial.print(" row(s) to ");
+  Serial.println(range);
+  return true;
 }
 
-void registerNewModuleToSheets(const String& moduleUID, uint8_t i2cAddress) {
-  // Append a row to Modules sheet: uid, address
-  ensureWiFi();
-  if (!isWiFiConnected()) return;
+// Append ledger sales not yet uploaded as one multi-row append. Runs on
+// the Sheets task only (the row buffer is shared).
+static Transaction s_uploadRows[LEDGER_UPLOAD_BATCH];
 
-  unsigned long start = millis();
-  while (!GSheet.ready() && millis() - start < 10000) delay(10);
+static bool appendTransactions() {
+  uint32_t through;
+  size_t count = ledgerUnsent(s_uploadRows, LEDGER_UPLOAD_BATCH, through);
+  if (count == 0) {
+    ledgerMarkUploaded(through);   // Only failed attempts: nothing to send
+    return true;
+  }
 
   FirebaseJson valueRange;
-  valueRange.add("range", "Modules!A:B");
+  valueRange.add("range", "Transactions!A:C");
   valueRange.add("majorDimension", "ROWS");
-  valueRange.set("values/[0]/[0]", moduleUID);
-  valueRange.set("values/[0]/[1]", String(i2cAddress));
+  for (size_t row = 0; row < count; ++row) {
+    // timestamp, itemCode, amount
+    const Transaction &t = s_uploadRows[row];
+    String base = "values/[" + String((int)row) + "]/";
+    valueRange.set(base + "[0]", transactionTimeString(t));
+    valueRange.set(base + "[1]", t.itemCode);
+    valueRange.set(base + "[2]", String(t.amountDispensed));
+  }
 
   FirebaseJson response;
-  bool ok = GSheet.values.append(&response, spreadsheetId, "Modules!A:B", &valueRange, "USER_ENTERED", "INSERT_ROWS", "true");
+  bool ok = GSheet.values.append(&response, spreadsheetId, "Transactions!A:C", &valueRange, "USER_ENTERED", "INSERT_ROWS", "true");
+  recordSheetsResult(ok);
   if (!ok) {
-    Serial.print("GSheet append module failed: ");
+    // Stays in the ledger; retried on the next flush
+    Serial.print("GSheet append failed for Transactions!A:C: ");
     Serial.println(GSheet.errorReason());
+    g_registry->logError(ERR_SHEETS_SYNC, "Batch append failed", GSheet.errorReason().c_str());
+    return false;
   }
+  ledgerMarkUploaded(through);
+  Serial.print("Appended ");
+  Serial.print((int)count);
+  Serial.println(" row(s) to Transactions!A:C");
+  return true;
 }
 
-bool isModuleRegistered(const String& moduleUID, uint8_t &outAddress) {
-  outAddress = 0;
-  ensureWiFi();
-  if (!isWiFiConnected()) return false;
+// Write all queued stock values with a single values:batchUpdate.
+// Returns true if there was nothing to send or the send worked.
+static bool sendStockBatch(const std::vector<SheetsWrite> &batch) {
+  size_t pending = 0;
+  for (auto &w : batch) if (w.type == WRITE_STOCK) ++pending;
+  if (pending == 0) return true;
 
-  unsigned long start = millis();
-  while (!GSheet.ready() && millis() - start < 10000) delay(10);
+  if (!s_productRowsValid && !refreshProductRowsFromSheet()) return false;
+
+  // Each cell is written as A:C with A/B null (skipped by the API) so the
+  // response echoes the row's item code and a misplaced write is caught.
+  FirebaseJsonArray valueRangeArr;
+  std::vector<const SheetsWrite*> sent;
+  for (auto &w : batch) {
+    if (w.type != WRITE_STOCK) continue;
+    uint16_t row;
+    if (!findProductRow(s_productRows, HashIndex::hashOf(w.key.c_str()), row)) {
+      // Not a transient failure: retrying won't make the code appear
+      Serial.print("Product code not found in sheet when updating stock: ");
+      Serial.println(w.key);
+      continue;
+    }
+
+    String target = "Products!A" + String(row) + ":C" + String(row);
+    FirebaseJson valueRange;
+    valueRange.add("range", target);
+    valueRange.add("majorDimension", "ROWS");
+    valueRange.set("values/[0]/[0]");
+    valueRange.set("values/[0]/[1]");
+    valueRange.set("values/[0]/[2]", String(w.value));
+    valueRangeArr.add(valueRange);
+    sent.push_back(&w);
+  }
+  if (sent.empty()) return true;
 
-  String resp;
-  bool ok = GSheet.values.get(&resp, spreadsheetId, "Modules!A2:B");
+  FirebaseJson response;
+  bool ok = GSheet.values.batchUpdate(&response, spreadsheetId, &valueRangeArr, "USER_ENTERED", "true");
+  recordSheetsResult(ok);
   if (!ok) {
-    Serial.print("GSheet read failed for Modules check: ");
+    Serial.print("GSheet batchUpdate failed: ");
     Serial.println(GSheet.errorReason());
+    g_registry->logError(ERR_SHEETS_SYNC, "updateStock failed", GSheet.errorReason().c_str());
     return false;
   }
 
-  std::vector<std::vector<String>> rows;
-  parseValuesJson(resp, rows);
+  for (size_t k = 0; k < sent.size(); ++k) {
+    FirebaseJsonData landed;
+    response.get(landed, "responses/[" + String((int)k) + "]/updatedData/values/[0]/[0]");
+    String landedCode = landed.success ? landed.stringValue : String("");
+    landedCode.trim();
+    if (landedCode == sent[k]->key) continue;
+
+    // The sheet changed under the index: the value went to another row
+    Serial.print("Stock write for ");
+    Serial.print(sent[k]->key);
+    Serial.print(" landed on row of '");
+    Serial.print(landedCode);
+    Serial.println("'");
+    g_registry->logError(ERR_STOCK_MISMATCH, "Stock write landed on wrong row", sent[k]->key.c_str());
+    invalidateProductRows("write landed on wrong code");
 
-  for (size_t i = 0; i < rows.size(); ++i) {
-    if (rows[i].size() < 1) continue;
-    if (rows[i][0] == moduleUID) {
-      if (rows[i].size() >= 2) outAddress = (uint8_t)rows[i][1].toInt();
-      return true;
+    // Re-queue the intended write (coalesces, so settleWrites keeps it)
+    // and restore the overwritten product from local data
+    enqueueWrite(WRITE_STOCK, sent[k]->key, sent[k]->value);
+    if (landedCode.length() > 0) {
+      int localStock;
+      if (!pendingStockFor(landedCode, localStock)) {
+        ProductItem *p = g_registry->findProduct(landedCode);
+        if (!p) continue;
+        localStock = p->stock;
+      }
+      enqueueWrite(WRITE_STOCK, landedCode, localStock);
     }
   }
 
-  return false;
+  Serial.print("Products sheet stock updated for ");
+  Serial.print((int)sent.size());
+  Serial.println(" item(s)");
+  return true;
+}
+
+void logTransactionToSheets(const char* itemCode, int amount) {
+  ledgerRecord(itemCode, amount, true);
+  if (s_sheetsTask) xTaskNotifyGive(s_sheetsTask);
+}
+
+void updateStockInSheets(const String& itemCode, int newStock) {
+  enqueueWrite(WRITE_STOCK, itemCode, newStock);
+}
+
+void logErrorToSheets(const String& errorMsg, const String& errorDetails) {
+  enqueueWrite(WRITE_ERROR, errorMsg, 0, errorDetails);
+}
+
+void registerNewModuleToSheets(const String& moduleUID, uint8_t i2cAddress) {
+  enqueueWrite(WRITE_MODULE, moduleUID, i2cAddress);
+}
+
+// Send everything queued so far as at most four requests. Each sheet is
+// settled independently, so one failing append doesn't resend the others.
+static void flushWriteQueue() {
+  std::vector<SheetsWrite> batch;
+  uint32_t lastId = snapshotWrites(batch);
+  if (batch.empty() && !ledgerHasUnsent()) return;
+
+  // Offline time doesn't count against a write's attempts, and neither
+  // does time with the breaker open: whatever isn't sent stays queued
+  if (!isSheetsReady()) return;
+  SheetsLock lock;
+
+  if (!breakerAllows()) return;
+  appendTransactions();
+  if (!breakerAllows()) return;
+  settleWrites(WRITE_ERROR,       lastId, appendBatch(batch, WRITE_ERROR, "Errors!A:C"));
+  if (!breakerAllows()) return;
+  settleWrites(WRITE_MODULE,      lastId, appendBatch(batch, WRITE_MODULE, "Modules!A:B"));
+  // A built snapshot learns about sales only from the queue, so stock
+  // must stay queued until publishSheetsSync() has overlaid it
+  if (s_snapshotState != SNAPSHOT_IDLE) return;
+  if (!breakerAllows()) return;
+  settleWrites(WRITE_STOCK,       lastId, sendStockBatch(batch));
+}
+
+// All background Sheets I/O runs here, off the core that runs loop()
+static void sheetsTask(void *arg) {
+  (void)arg;
+  for (;;) {
+    // Woken by enqueueWrite() / requestSheetsSync(); the timeout doubles
+    // as the retry interval. Poll faster while a token is being acquired.
+    unsigned long wait = isSheetsReady() ? SHEETS_RETRY_MS : SHEETS_AUTH_POLL_MS;
+    bool woken = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait)) > 0;
+    pollSheetsAuth();
+    // A sync requested while offline waits here until it can run
+    if (s_syncRequested && isSheetsReady()) {
+      s_syncRequested = false;
+      buildSnapshot();
+    } else if (woken) {
+      // Let writes from the same burst of activity join this flush
+      vTaskDelay(pdMS_TO_TICKS(SHEETS_FLUSH_WINDOW_MS));
+    }
+    flushWriteQueue();
+  }
+}
+
+void startSheetsTask() {
+  if (s_sheetsTask) return;
+  xTaskCreatePinnedToCore(sheetsTask, "sheets", SHEETS_TASK_STACK,
+                          nullptr, 1, &s_sheetsTask, SHEETS_TASK_CORE);
+}
+
+struct ModuleLookup {
+  const String *uid;
+  bool found;
+  uint8_t address;
+};
+
+// Row callback for isModuleRegistered(): first Modules row whose UID matches
+static void findModuleRow(const SheetsRow &row, void *ctx) {
+  ModuleLookup *lookup = static_cast<ModuleLookup*>(ctx);
+  if (lookup->found || row.count < 1) return;
+  if (!row.cell(0).equals(*lookup->uid)) return;
+  lookup->found = true;
+  lookup->address = (uint8_t)row.cell(1).toLong(0);
+}
+
+bool isModuleRegistered(const String& moduleUID, uint8_t &outAddress) {
+  outAddress = 0;
+  if (!isSheetsReady()) return false;
+  SheetsLock lock;
+  if (!breakerAllows()) return false;
+
+  ModuleLookup lookup = { &moduleUID, false, 0 };
+  if (!readSheetRange("Modules!A2:B", findModuleRow, &lookup)) {
+    Serial.print("GSheet read failed for Modules check: ");
+    Serial.println(s_readError);
+    return false;
+  }
+  outAddress = lookup.address;
+  return lookup.found;
 }
 
 void tokenStatusCallback(TokenInfo info)
@@ -0,0 +1,435 @@
+#include "i2cengine.h"
+#include "config.h"
+#include "datatypes.h"
+#include <Wire.h>
+
+// ===================== JOB QUEUE =====================================
+// FIFO ring; the head job owns the bus until it completes.
+
+enum JobPhase : uint8_t {
+  PHASE_WRITE = 0,           // Start an attempt: write tx
+  PHASE_READ = 1             // Read a reply (after settle / between polls)
+};
+
+struct I2cJob {
+  I2cRequest req;
+  JobPhase phase;
+  uint8_t attempt;           // Attempts started so far
+  unsigned long submittedAt;
+  unsigned long attemptAt;   // When the current attempt's write finished
+  unsigned long wakeAt;      // Next step not before this
+  uint16_t pollMs;           // Current poll interval (backs off to pollMaxMs)
+  uint8_t rx[I2C_RX_MAX];
+  uint8_t rxLen;
+};
+
+static I2cJob s_jobs[I2C_QUEUE_DEPTH];
+static uint8_t s_head = 0;
+static uint8_t s_count = 0;
+static bool s_servicing = false;   // Inside i2cService() (and its callbacks)
+
+I2cRequest i2cRequest(uint8_t addr) {
+  I2cRequest r;
+  memset(&r, 0, sizeof(r));
+  r.addr =      addr;
+  r.rxLen =     1;
+  r.settleMs =  I2C_SETTLE_MS;
+  r.pollMs =    I2C_POLL_MS;
+  r.timeoutMs = I2C_RESPONSE_TIMEOUT;
+  r.retryDelayMs = I2C_RETRY_DELAY_MS;
+  r.attempts =  I2C_MAX_RETRIES;
+  r.idempotent = true;
+  return r;
+}
+
+bool i2cSubmit(const I2cRequest &req) {
+  if (s_count >= I2C_QUEUE_DEPTH) return false;
+  I2cJob &job = s_jobs[(s_head + s_count) % I2C_QUEUE_DEPTH];
+  job.req = req;
+  job.phase = PHASE_WRITE;
+  job.attempt = 0;
+  job.submittedAt = millis();
+  job.wakeAt = job.submittedAt;
+  job.rxLen = 0;
+  ++s_count;
+  return true;
+}
+
+size_t i2cPending() {
+  return s_count;
+}
+
+bool i2cBusy(uint8_t addr) {
+  for (uint8_t i = 0; i < s_count; ++i) {
+    if (s_jobs[(s_head + i) % I2C_QUEUE_DEPTH].req.addr == addr) return true;
+  }
+  return false;
+}
+
+// ===================== ATTENTION LINE ================================
+// Edge-triggered: a line held low (stuck, or by a module not yet read)
+// can't make the engine read back to back; the fallback poll covers it.
+
+static volatile bool s_attention = false;   // Line fell since the last read
+
+static void IRAM_ATTR onAttention() {
+  s_attention = true;
+}
+
+void i2cBegin() {
+  Wire.setClock(I2C_CLOCK_STANDARD);
+  if (I2C_ATTN_PIN < 0) return;
+  pinMode(I2C_ATTN_PIN, INPUT_PULLUP);
+  attachInterrupt(digitalPinToInterrupt(I2C_ATTN_PIN), onAttention, FALLING);
+}
+
+bool i2cHasAttention() {
+  return I2C_ATTN_PIN >= 0;
+}
+
+// ===================== BUS CLOCK =====================================
+
+static uint32_t s_clockTarget = I2C_CLOCK_STANDARD;   // What the devices support
+static uint32_t s_clockCeiling = I2C_CLOCK_FAST_PLUS; // Lowered by error bursts
+static uint32_t s_clockHz = I2C_CLOCK_STANDARD;       // Running now
+static unsigned long s_ceilingAt = 0;                 // Last ceiling change
+static uint8_t s_windowTransfers = 0;
+static uint8_t s_windowErrors = 0;
+
+static uint32_t clockBelow(uint32_t hz) {
+  return hz > I2C_CLOCK_FAST ? I2C_CLOCK_FAST : I2C_CLOCK_STANDARD;
+}
+
+static uint32_t clockAbove(uint32_t hz) {
+  return hz < I2C_CLOCK_FAST ? I2C_CLOCK_FAST : I2C_CLOCK_FAST_PLUS;
+}
+
+static void applyClock() {
+  uint32_t hz = s_clockTarget < s_clockCeiling ? s_clockTarget : s_clockCeiling;
+  if (hz == s_clockHz) return;
+  Wire.setClock(hz);
+  s_clockHz = hz;
+  s_windowTransfers = 0;
+  s_windowErrors = 0;
+  Serial.print("I2C clock: ");
+  Serial.print(hz / 1000);
+  Serial.println(" kHz");
+}
+
+void i2cSetClockTarget(uint32_t hz) {
+  s_clockTarget = hz < I2C_CLOCK_STANDARD ? I2C_CLOCK_STANDARD : hz;
+  applyClock();
+}
+
+uint32_t i2cClock() {
+  return s_clockHz;
+}
+
+static void trackHang(const I2cJob &job, bool error, bool busFault);
+
+// Count one bus transfer of the head job towards the error rate
+static void noteTransfer(const I2cJob &job, bool error, bool busFault = false) {
+  trackHang(job, error, busFault);
+  if (job.req.probe) return;
+  ++s_windowTransfers;
+  if (error) ++s_windowErrors;
+
+  if (s_windowErrors >= I2C_CLOCK_ERROR_LIMIT && s_clockHz > I2C_CLOCK_STANDARD) {
+    s_clockCeiling = clockBelow(s_clockHz);
+    s_ceilingAt = millis();
+    char khz[12];
+    utoa(s_clockCeiling / 1000, khz, 10);
+    ProductRegistry::logError(ERR_I2C_COMM, "Bus errors: clock stepped down (kHz)", khz);
+    applyClock();
+  } else if (s_windowTransfers >= I2C_CLOCK_WINDOW) {
+    s_windowTransfers = 0;
+    s_windowErrors = 0;
+  }
+}
+
+// After a quiet spell below target, try one step up
+static void recoverClock() {
+  if (s_clockCeiling >= s_clockTarget) return;
+  if (millis() - s_ceilingAt < I2C_CLOCK_RECOVER_MS) return;
+  s_clockCeiling = clockAbove(s_clockCeiling);
+  s_ceilingAt = millis();
+  applyClock();
+}
+
+// ===================== BUS RECOVERY ==================================
+
+struct Quarantine {
+  uint8_t addr;              // 0 = free slot
+  uint8_t strikes;           // Hangs blamed on this address
+  unsigned long until;       // Isolated while millis() is before this
+};
+
+static Quarantine s_quarantine[I2C_QUARANTINE_SLOTS];
+static uint8_t s_failStreak = 0;
+static uint8_t s_lastGoodAddr = 0;         // Last address a transfer succeeded with
+static uint8_t s_suspect = 0;              // s_lastGoodAddr when the streak began
+static uint8_t s_streakAddr = 0;           // First address to fail in the streak
+static bool s_streakSpread = false;        // ...and another address has failed since
+static bool s_hangSuspected = false;
+static unsigned long s_recoverHoldUntil = 0;
+static uint16_t s_recoveries = 0;
+static unsigned long s_lastRecoveryUs = 0;
+static unsigned long s_maxRecoveryUs = 0;
+
+static void trackHang(const I2cJob &job, bool error, bool busFault) {
+  if (!error) {
+    s_failStreak = 0;
+    s_lastGoodAddr = job.req.addr;
+    return;
+  }
+  // An empty address NACKing a probe says nothing about the bus
+  if (job.req.probe && !busFault) return;
+  if (s_failStreak == 0) {
+    s_suspect = s_lastGoodAddr;
+    s_streakAddr = job.req.addr;
+    s_streakSpread = false;
+  } else if (job.req.addr != s_streakAddr) {
+    s_streakSpread = true;
+  }
+  if (s_failStreak < 255) ++s_failStreak;
+  // One address failing on its own is that module's problem (it goes
+  // offline); a stuck line fails whatever is addressed
+  if (busFault || (s_failStreak >= I2C_HANG_STREAK && s_streakSpread)) s_hangSuspected = true;
+}
+
+static bool isQuarantined(uint8_t addr) {
+  for (uint8_t i = 0; i < I2C_QUARANTINE_SLOTS; ++i) {
+    const Quarantine &q = s_quarantine[i];
+    if (q.addr == addr && (long)(millis() - q.until) < 0) return true;
+  }
+  return false;
+}
+
+static void quarantine(uint8_t addr) {
+  Quarantine *slot = nullptr;
+  for (uint8_t i = 0; i < I2C_QUARANTINE_SLOTS && !slot; ++i) {
+    if (s_quarantine[i].addr == addr) slot = &s_quarantine[i];
+  }
+  // New address: take a free slot, else the one whose isolation ends first
+  for (uint8_t i = 0; i < I2C_QUARANTINE_SLOTS && !slot; ++i) {
+    if (s_quarantine[i].addr == 0) slot = &s_quarantine[i];
+  }
+  if (!slot) {
+    slot = &s_quarantine[0];
+    for (uint8_t i = 1; i < I2C_QUARANTINE_SLOTS; ++i) {
+      if ((long)(s_quarantine[i].until - slot->until) < 0) slot = &s_quarantine[i];
+    }
+  }
+  if (slot->addr != addr) slot->strikes = 0;
+  slot->addr = addr;
+  if (slot->strikes < 8) ++slot->strikes;
+  slot->until = millis() + ((unsigned long)I2C_QUARANTINE_MS << (slot->strikes - 1));
+}
+
+// Release a held bus: with the driver stopped, clock SCL (at most one byte
+// plus ACK) until the device driving SDA lets go, then send a STOP.
+// Returns whether a line was stuck; `freed` says whether both are high now.
+static bool releaseBus(bool &freed) {
+  Wire.end();
+  pinMode(I2C_SDA, INPUT_PULLUP);
+  pinMode(I2C_SCL, INPUT_PULLUP);
+  bool stuck = digitalRead(I2C_SDA) == LOW || digitalRead(I2C_SCL) == LOW;
+
+  if (stuck) {
+    pinMode(I2C_SCL, OUTPUT_OPEN_DRAIN);
+    for (uint8_t pulse = 0; pulse < 9 && digitalRead(I2C_SDA) == LOW; ++pulse) {
+      digitalWrite(I2C_SCL, LOW);
+      delayMicroseconds(5);
+      digitalWrite(I2C_SCL, HIGH);
+      delayMicroseconds(5);
+    }
+    pinMode(I2C_SDA, OUTPUT_OPEN_DRAIN);
+    digitalWrite(I2C_SDA, LOW);
+    delayMicroseconds(5);
+    digitalWrite(I2C_SCL, HIGH);
+    delayMicroseconds(5);
+    digitalWrite(I2C_SDA, HIGH);
+    delayMicroseconds(5);
+    pinMode(I2C_SDA, INPUT_PULLUP);
+    pinMode(I2C_SCL, INPUT_PULLUP);
+  }
+  freed = digitalRead(I2C_SDA) == HIGH && digitalRead(I2C_SCL) == HIGH;
+
+  Wire.begin(I2C_SDA, I2C_SCL);
+  Wire.setClock(s_clockHz);
+  return stuck;
+}
+
+static void recoverBus() {
+  s_hangSuspected = false;
+  s_failStreak = 0;
+  if ((long)(millis() - s_recoverHoldUntil) < 0) return;
+
+  unsigned long started = micros();
+  bool freed;
+  bool stuck = releaseBus(freed);
+  unsigned long took = micros() - started;
+
+  ++s_recoveries;
+  s_lastRecoveryUs = took;
+  if (took > s_maxRecoveryUs) s_maxRecoveryUs = took;
+  // The head job's transfer was cut short; start its attempt again,
+  // unless it is a command the module already has and can't take twice
+  if (s_count > 0 && s_jobs[s_head].req.idempotent) s_jobs[s_head].phase = PHASE_WRITE;
+
+  Serial.print("I2C bus ");
+  Serial.print(stuck ? (freed ? "hang cleared" : "still stuck") : "driver reset");
+  Serial.print(" in ");
+  Serial.print(took);
+  Serial.println(" us");
+
+  if (!freed) {
+    s_recoverHoldUntil = millis() + I2C_HANG_BACKOFF_MS;
+    ProductRegistry::logError(ERR_I2C_COMM, "Bus stuck low after recovery", s_suspect);
+    return;
+  }
+  if (stuck && s_suspect != 0) {
+    quarantine(s_suspect);
+    ProductRegistry::logError(ERR_I2C_COMM, "Bus hang cleared; address quarantined", s_suspect);
+  }
+}
+
+void i2cPrintBusHealth() {
+  Serial.print("I2C clock: "); Serial.print(s_clockHz / 1000); Serial.println(" kHz");
+  Serial.print("Bus recoveries: "); Serial.print(s_recoveries);
+  Serial.print(" last="); Serial.print(s_lastRecoveryUs);
+  Serial.print("us max="); Serial.print(s_maxRecoveryUs); Serial.println("us");
+  for (uint8_t i = 0; i < I2C_QUARANTINE_SLOTS; ++i) {
+    const Quarantine &q = s_quarantine[i];
+    if (!q.addr || !isQuarantined(q.addr)) continue;
+    Serial.print("Quarantined 0x"); Serial.print(q.addr, HEX);
+    Serial.print(" strikes="); Serial.print(q.strikes);
+    Serial.print(" for "); Serial.print((q.until - millis()) / 1000); Serial.println(" s");
+  }
+}
+
+// ===================== JOB STATE MACHINE =============================
+
+// Pop the head job and report it. The job is copied out first so the
+// callback may submit new requests into the freed slot.
+static void finishJob(I2cStatus status) {
+  I2cJob job = s_jobs[s_head];
+  s_head = (s_head + 1) % I2C_QUEUE_DEPTH;
+  --s_count;
+  if (!job.req.done) return;
+
+  I2cResult r;
+  r.addr = job.req.addr;
+  r.status = status;
+  memcpy(r.rx, job.rx, job.rxLen);
+  r.rxLen = job.rxLen;
+  r.elapsedMs = millis() - job.submittedAt;
+  r.responseMs = millis() - job.attemptAt;
+  job.req.done(r, job.req.ctx);
+}
+
+static void retryJob(I2cJob &job, unsigned long now, I2cStatus failure = I2C_TIMEOUT) {
+  // Once a non-idempotent command's write was taken, a resend could run
+  // it twice: the attempt in flight is the last one
+  bool written = job.phase == PHASE_READ;
+  if (job.attempt >= job.req.attempts || (written && !job.req.idempotent)) {
+    finishJob(failure);
+    return;
+  }
+  job.phase = PHASE_WRITE;
+  job.wakeAt = now + job.req.retryDelayMs;
+}
+
+// Read again `wait` ms from now, or start the next attempt if this one
+// has run out of time
+static void pollAgain(I2cJob &job, unsigned long now, uint16_t wait) {
+  if (now - job.attemptAt >= job.req.timeoutMs) {
+    retryJob(job, now);
+    return;
+  }
+  if (job.req.attention && i2cHasAttention() && wait < I2C_ATTN_FALLBACK_MS) {
+    wait = I2C_ATTN_FALLBACK_MS;
+  }
+  job.wakeAt = now + wait;
+  if (job.req.pollMaxMs) {
+    uint32_t next = (uint32_t)job.pollMs * 2;
+    job.pollMs = next > job.req.pollMaxMs ? job.req.pollMaxMs : (uint16_t)next;
+  }
+}
+
+// Act on the check's verdict for the reply just read
+static void judgeReply(I2cJob &job, unsigned long now) {
+  uint16_t wait = job.pollMs;
+  I2cVerdict verdict = job.req.check(job.req, job.rx, job.rxLen, wait);
+  noteTransfer(job, verdict == I2C_RETRY);
+  switch (verdict) {
+    case I2C_ACCEPT:
+      finishJob(I2C_OK);
+      break;
+    case I2C_REJECT:
+      finishJob(I2C_REJECTED);
+      break;
+    case I2C_RETRY:
+      retryJob(job, now);
+      break;
+    case I2C_KEEP_POLLING:
+      pollAgain(job, now, wait);
+      break;
+  }
+}
+
+void i2cService() {
+  if (s_servicing) return;
+  if (s_hangSuspected) recoverBus();
+  recoverClock();
+  if (s_count == 0) return;
+  I2cJob &job = s_jobs[s_head];
+  bool signalled = job.phase == PHASE_READ && job.req.attention && s_attention;
+  if ((long)(millis() - job.wakeAt) < 0 && !signalled) return;
+  s_servicing = true;
+
+  if (job.phase == PHASE_WRITE && isQuarantined(job.req.addr)) {
+    finishJob(I2C_NACK);   // Kept off the bus
+  } else if (job.phase == PHASE_WRITE) {
+    ++job.attempt;
+    Wire.beginTransmission(job.req.addr);
+    Wire.write(job.req.tx, job.req.txLen);
+    int err = Wire.endTransmission();
+    job.attemptAt = millis();
+    job.pollMs = job.req.pollMs;
+    // 4: bus error, 5: timeout (ESP32 core); a NACK is 2 or 3
+    noteTransfer(job, err != 0, err >= 4);
+    if (err != 0) {
+      retryJob(job, job.attemptAt, I2C_NACK);
+    } else if (!job.req.check) {
+      finishJob(I2C_OK);   // Write-only request
+    } else {
+      job.phase = PHASE_READ;
+      job.wakeAt = job.attemptAt + job.req.settleMs;
+    }
+  } else {
+    s_attention = false;   // This read answers any edge so far
+    uint8_t got = Wire.requestFrom((int)job.req.addr, (int)job.req.rxLen);
+    job.rxLen = 0;
+    while (Wire.available()) {
+      uint8_t b = Wire.read();
+      if (job.rxLen < I2C_RX_MAX) job.rx[job.rxLen++] = b;
+    }
+
+    unsigned long now = millis();
+    if (got == 0 && job.req.idempotent) {
+      // Address not acknowledged: the module is gone, not just busy, so
+      // fail the attempt now instead of polling out the timeout
+      noteTransfer(job, true);
+      retryJob(job, now, I2C_NACK);
+    } else if (got == 0) {
+      // The write was taken, and a module busy carrying it out may not
+      // answer reads; resending early could run the command twice
+      pollAgain(job, now, job.pollMs);
+    } else {
+      judgeReply(job, now);
+    }
+  }
+
+  s_servicing = false;
+}
@@ -0,0 +1,203 @@
+#include "ledger.h"
+#include "config.h"
+#include <math.h>
+#include "time.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+// ===================== LEDGER STATE ================================
+// Ring of transactions by sequence: entry n lives in slot
+// n & (LEDGER_CAPACITY - 1). Sequences start at 1, so 0 means "none yet".
+
+// Both tables are indexed by masking
+static_assert((LEDGER_CAPACITY & (LEDGER_CAPACITY - 1)) == 0, "LEDGER_CAPACITY must be a power of two");
+static_assert((LEDGER_STATS_SLOTS & (LEDGER_STATS_SLOTS - 1)) == 0, "LEDGER_STATS_SLOTS must be a power of two");
+
+struct SalesSlot {
+  char itemCode[ITEM_CODE_LEN + 1];   // "" if free
+  SalesStats stats;
+  unsigned long rateAt;      // millis() ratePerHour was last decayed to
+};
+
+static Transaction s_ledger[LEDGER_CAPACITY];
+static uint32_t s_lastSequence = 0;        // Newest recorded
+static uint32_t s_uploadedThrough = 0;     // Newest uploaded (or skipped)
+static SalesSlot s_sales[LEDGER_STATS_SLOTS];
+static SemaphoreHandle_t s_ledgerLock = xSemaphoreCreateMutex();
+
+struct LedgerLock {
+  LedgerLock()  { xSemaphoreTake(s_ledgerLock, portMAX_DELAY); }
+  ~LedgerLock() { xSemaphoreGive(s_ledgerLock); }
+};
+
+static uint32_t oldestSequence() {
+  return s_lastSequence > LEDGER_CAPACITY ? s_lastSequence - LEDGER_CAPACITY + 1 : 1;
+}
+
+static const Transaction& entryAt(uint32_t sequence) {
+  return s_ledger[sequence & (LEDGER_CAPACITY - 1)];
+}
+
+// ===================== SALES COUNTERS ==============================
+// Open addressing over a fixed table; a full table stops tracking new
+// codes (their transactions are still in the ring).
+
+static SalesSlot* salesSlot(const char* itemCode, bool create) {
+  uint32_t mask = LEDGER_STATS_SLOTS - 1;
+  uint32_t pos = HashIndex::hashOf(itemCode) & mask;
+  for (uint32_t probe = 0; probe < LEDGER_STATS_SLOTS; ++probe) {
+    SalesSlot& slot = s_sales[(pos + probe) & mask];
+    if (strcmp(slot.itemCode, itemCode) == 0) return &slot;
+    if (!slot.itemCode[0]) {
+      if (!create) return nullptr;
+      copyField(slot.itemCode, sizeof(slot.itemCode), itemCode);
+      memset(&slot.stats, 0, sizeof(slot.stats));
+      slot.rateAt = millis();
+      return &slot;
+    }
+  }
+  return nullptr;
+}
+
+// Rate decayed to `now`: each sale adds one per window-length, and the
+// total falls off exponentially with the same time constant
+static float decayedRate(const SalesSlot& slot, unsigned long now) {
+  float age = (float)(now - slot.rateAt) / LEDGER_RATE_WINDOW_MS;
+  return slot.stats.ratePerHour * expf(-age);
+}
+
+// ===================== RECORDING ===================================
+
+void ledgerRecord(const char* itemCode, int amount, bool successful) {
+  unsigned long now = millis();
+  time_t wall = time(nullptr);
+
+  LedgerLock lock;
+  uint32_t sequence = ++s_lastSequence;
+  Transaction& t = s_ledger[sequence & (LEDGER_CAPACITY - 1)];
+  t.sequence = sequence;
+  copyField(t.itemCode, sizeof(t.itemCode), itemCode);
+  t.amountDispensed = (int16_t)amount;
+  t.timestamp = now;
+  t.epoch = wall > 1000000000 ? (uint32_t)wall : 0;
+  t.successful = successful;
+
+  SalesSlot* slot = salesSlot(itemCode, true);
+  if (!slot) return;
+  if (!successful) {
+    ++slot->stats.failures;
+    return;
+  }
+  slot->stats.ratePerHour = decayedRate(*slot, now) + 3600000.0f / LEDGER_RATE_WINDOW_MS;
+  slot->rateAt = now;
+  ++slot->stats.sales;
+  slot->stats.units += amount;
+  slot->stats.lastSale = now;
+}
+
+size_t ledgerRecent(Transaction* out, size_t max) {
+  LedgerLock lock;
+  size_t n = 0;
+  for (uint32_t seq = s_lastSequence; seq >= oldestSequence() && seq > 0 && n < max; --seq) {
+    out[n++] = entryAt(seq);
+  }
+  return n;
+}
+
+bool ledgerStats(const char* itemCode, SalesStats& out) {
+  LedgerLock lock;
+  const SalesSlot* slot = salesSlot(itemCode, false);
+  if (!slot) return false;
+  out = slot->stats;
+  out.ratePerHour = decayedRate(*slot, millis());
+  return true;
+}
+
+// ===================== UPLOAD CURSOR ===============================
+
+bool ledgerHasUnsent() {
+  LedgerLock lock;
+  for (uint32_t seq = s_uploadedThrough + 1; seq <= s_lastSequence; ++seq) {
+    if (seq >= oldestSequence() && entryAt(seq).successful) return true;
+  }
+  return false;
+}
+
+size_t ledgerUnsent(Transaction* out, size_t max, uint32_t& through) {
+  uint32_t lost = 0;
+  size_t n = 0;
+  {
+    LedgerLock lock;
+    uint32_t oldest = oldestSequence();
+    if (s_uploadedThrough + 1 < oldest) {
+      lost = oldest - 1 - s_uploadedThrough;
+      s_uploadedThrough = oldest - 1;
+    }
+    through = s_uploadedThrough;
+    for (uint32_t seq = s_uploadedThrough + 1; seq <= s_lastSequence && n < max; ++seq) {
+      const Transaction& t = entryAt(seq);
+      if (t.successful) out[n++] = t;
+      through = seq;
+    }
+  }
+
+  if (lost > 0) {
+    char count[12];
+    utoa(lost, count, 10);
+    ProductRegistry::logError(ERR_SHEETS_SYNC, "Ledger overwrote unsent transactions", count);
+  }
+  return n;
+}
+
+void ledgerMarkUploaded(uint32_t through) {
+  LedgerLock lock;
+  if (through > s_uploadedThrough) s_uploadedThrough = through;
+}
+
+// ===================== SERIAL REPORTS ==============================
+
+void ledgerPrintRecent(size_t max) {
+  Transaction recent[16];
+  if (max > 16) max = 16;
+  size_t n = ledgerRecent(recent, max);
+  uint32_t uploaded;
+  {
+    LedgerLock lock;
+    uploaded = s_uploadedThrough;
+  }
+
+  Serial.println("--- Transaction Ledger ---");
+  if (n == 0) Serial.println("(no transactions)");
+  for (size_t i = 0; i < n; ++i) {
+    const Transaction &t = recent[i];
+    Serial.print("#"); Serial.print(t.sequence);
+    Serial.print(" ["); Serial.print(t.timestamp); Serial.print("] ");
+    Serial.print("code="); Serial.print(t.itemCode);
+    Serial.print(" amount="); Serial.print(t.amountDispensed);
+    Serial.print(t.successful ? " ok" : " FAILED");
+    if (t.successful && t.sequence > uploaded) Serial.print(" (not uploaded)");
+    Serial.println();
+  }
+}
+
+void ledgerPrintSales() {
+  Serial.println("--- Sales Since Boot ---");
+  bool any = false;
+  for (size_t i = 0; i < LEDGER_STATS_SLOTS; ++i) {
+    char code[ITEM_CODE_LEN + 1];
+    {
+      LedgerLock lock;
+      memcpy(code, s_sales[i].itemCode, sizeof(code));
+    }
+    SalesStats st;
+    if (!code[0] || !ledgerStats(code, st)) continue;
+    any = true;
+    Serial.print("code="); Serial.print(code);
+    Serial.print(" sales="); Serial.print(st.sales);
+    Serial.print(" units="); Serial.print(st.units);
+    Serial.print(" failures="); Serial.print(st.failures);
+    Serial.print(" rate/h="); Serial.print(st.ratePerHour, 2);
+    Serial.print(" lastSale="); Serial.println(st.lastSale);
+  }
+  if (!any) Serial.println("(no sales)");
+}
@@ -8,6 +8,8 @@
 #include "fsm.h"
 #include "productmoduleinterface.h"
 #include "googlesheets.h"
+#include "ledger.h"
+#include "i2cengine.h"
 
 // ===================== HARDWARE INSTANCES ==============================
 
@@ -43,7 +45,11 @@ Event detectEvent() {
     return EVT_KEY_CHAR;
   }
 
-  // Priority 2: Periodic sync check (in IDLE only)
+  // Priority 2: Completions posted by the I2C engine (dispense ACK/error)
+  Event posted = takePostedEvent();
+  if (posted != EVT_NONE) return posted;
+
+  // Priority 3: Periodic sync check (in IDLE only)
   if (currentState == STATE_IDLE) {
     unsigned long now = millis();
     if (now - syncTimer > SYNC_INTERVAL_MS) {
@@ -96,6 +102,36 @@ void processEventLoop() {
   onStateAction(currentState);
 }
 
+// ===================== SERIAL COMMANDS ===================================
+// One word per line, for diagnostics on site without a Sheets read:
+//   tx      recent transactions     sales   per-product sales counters
+//   errors  error counters / log    modules module registry, I2C bus health
+
+static char serialLine[16];
+static size_t serialLen = 0;
+
+void pollSerialCommands() {
+  while (Serial.available()) {
+    char c = (char)Serial.read();
+    if (c != '\n' && c != '\r') {
+      if (serialLen < sizeof(serialLine) - 1) serialLine[serialLen++] = c;
+      continue;
+    }
+    if (serialLen == 0) continue;
+    serialLine[serialLen] = '\0';
+    serialLen = 0;
+
+    if (strcmp(serialLine, "tx") == 0) ledgerPrintRecent(16);
+    else if (strcmp(serialLine, "sales") == 0) ledgerPrintSales();
+    else if (strcmp(serialLine, "errors") == 0) ProductRegistry::debugPrintErrors();
+    else if (strcmp(serialLine, "modules") == 0) {
+      g_registry->debugPrintModules();
+      i2cPrintBusHealth();
+    }
+    else Serial.println("Commands: tx, sales, errors, modules");
+  }
+}
+
 // ===================== INITIALIZATION ====================================
 
 void setup() {
@@ -106,7 +142,8 @@ void setup() {
   
   // Initialize I2C for product modules
   Wire.begin();
-  Serial.println("[1/5] I2C initialized");
+  i2cBegin();
+  Serial.println("[1/6] I2C initialized");
   
   // Initialize LCD display
   lcd.init(I2C_SDA, I2C_SCL);
@@ -116,29 +153,47 @@ void setup() {
   lcd.print("VENDING SYSTEM");
   lcd.setCursor(0, 1);
   lcd.print("Initializing...");
-  Serial.println("[2/5] LCD initialized");
+  Serial.println("[2/6] LCD initialized");
   
   delay(1000);
   
-  // Initialize WiFi
-  WiFi.mode(WIFI_STA);
-  WiFi.begin(WIFI_SSID, WIFI_PASS);
-  Serial.println("[3/5] WiFi connection started");
-  
-  // Discover product modules on I2C bus
-  discoverProductModules();
-  Serial.println("[4/5] Module discovery complete");
-  
-  // Sync initial product data from Google Sheets
-  ensureWiFi();
-  if (isWiFiConnected()) {
-    syncProductDataFromSheets();
-    matchModulesToSheets();
-    syncModuleDisplays();
-    Serial.println("[5/5] Google Sheets sync complete");
+  // Warm boot: restore the last synced catalog before any network I/O
+  bool warmBoot = g_registry->loadSnapshot();
+  if (warmBoot) {
+    Serial.println("[3/6] Catalog restored from flash snapshot");
+    g_registry->debugPrintProducts();
   } else {
-    Serial.println("[!] WiFi not connected - will sync when available");
+    Serial.println("[3/6] No catalog snapshot - cold boot");
   }
+
+  // Initialize WiFi; loop() keeps ticking the connection from here on
+  tickConnection();
+  Serial.println("[4/6] WiFi connection started");
+
+  // Sheets writes and periodic syncs run on a background task from here on
+  startSheetsTask();
+
+  // Cold boot has nothing to sell until the first sync, so that is the
+  // one case that waits for the network, and only so long
+  if (!warmBoot) {
+    waitForSheetsReady(BOOT_CONNECT_TIMEOUT_MS);
+    if (isSheetsReady()) {
+      syncProductDataFromSheets();
+      Serial.println("[5/6] Google Sheets sync complete");
+    } else {
+      Serial.println("[!] WiFi not connected - will sync when available");
+    }
+  }
+
+  // Discover product modules on I2C bus: last-known addresses now, the
+  // rest of the bus in the background from loop()
+  discoverProductModules();
+  syncModuleDisplays();
+  Serial.println("[6/6] Known modules online");
+
+  // Reconcile with Sheets in the background; the result is swapped in
+  // from IDLE like any periodic sync
+  if (warmBoot || g_registry->getProducts().empty()) requestSheetsSync();
   
   // Initialize FSM
   initFSM();
@@ -150,6 +205,17 @@ void setup() {
 // ===================== MAIN LOOP ==========================================
 
 void loop() {
+  // Non-blocking WiFi/NTP step; never stalls key handling
+  tickConnection();
+
+  // Diagnostics typed into the serial monitor
+  pollSerialCommands();
+
+  // One step of any queued module transaction (never blocks)
+  i2cService();
+  tickDiscovery();
+  checkModuleHealth();
+
   // Process events and state machine
   processEventLoop();
 }
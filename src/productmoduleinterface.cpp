@@ -1,289 +1,837 @@
 #include "productmoduleinterface.h"
 #include "googlesheets.h"
+#include "ledger.h"
+#include <LittleFS.h>
 
-// Retry/ACK configuration for I2C reliability
-static const int I2C_MAX_RETRIES = 3;
-static const int I2C_RETRY_DELAY_MS = 100;
+// ===================== PROTOCOL V2 FRAMING =============================
+// Frame layout and commands are in config.h. Which modules speak v2 is
+// learned per address when they are discovered (a STATUS probe); the
+// others get the bare v1 commands.
 
-// ===================== I2C PROTOCOL IMPLEMENTATION ======================
+#define ADDRESS_MAP_BYTES 16             // One bit per 7-bit address
 
-bool i2c_whoami(uint8_t addr, String &moduleUID) {
-  moduleUID = "";
-  for (int attempt = 0; attempt < I2C_MAX_RETRIES; ++attempt) {
-    Wire.beginTransmission(addr);
-    Wire.write(CMD_WHOAMI);
-    int tx = Wire.endTransmission();
-    if (tx != 0) {
-      // transmission failed; retry
-      if (attempt < I2C_MAX_RETRIES - 1) delay(I2C_RETRY_DELAY_MS);
-      continue;
-    }
+static uint8_t s_framedMap[ADDRESS_MAP_BYTES];   // Modules that speak v2
+static uint8_t s_attentionMap[ADDRESS_MAP_BYTES]; // ...and drive the attention line
+static uint8_t s_fastMap[ADDRESS_MAP_BYTES];      // ...and run at 400 kHz
+static uint8_t s_fastPlusMap[ADDRESS_MAP_BYTES];  // ...and at 1 MHz
+static uint8_t s_sequence = 0;                   // Last v2 sequence number used
 
-    delay(10);
-    Wire.requestFrom((int)addr, 32);
+static bool mapTest(const uint8_t *map, uint8_t addr) {
+  return map[addr >> 3] & (1 << (addr & 7));
+}
 
-    moduleUID = "";
-    while (Wire.available()) {
-      char c = Wire.read();
-      if (c == 0) break;
-      moduleUID += c;
-    }
-    moduleUID.trim();
+static void mapSet(uint8_t *map, uint8_t addr, bool on) {
+  if (on) map[addr >> 3] |= (1 << (addr & 7));
+  else map[addr >> 3] &= ~(1 << (addr & 7));
+}
 
-    if (moduleUID.length() > 0) {
-      return true;
+static bool isFramed(uint8_t addr) {
+  return addr < 128 && mapTest(s_framedMap, addr);
+}
+
+// CRC-8, polynomial 0x07, initial value 0
+static uint8_t crc8(const uint8_t *data, size_t len) {
+  uint8_t crc = 0;
+  while (len--) {
+    crc ^= *data++;
+    for (uint8_t bit = 0; bit < 8; ++bit) {
+      crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
     }
+  }
+  return crc;
+}
 
-    // no response, retry
-    if (attempt < I2C_MAX_RETRIES - 1) delay(I2C_RETRY_DELAY_MS);
+// Wrap `cmd` and its payload in a v2 frame with a new sequence number.
+// Retries resend the same frame, which is how a module tells a repeated
+// command from a new one.
+static void frameRequest(I2cRequest &r, uint8_t cmd, const uint8_t *payload, uint8_t len,
+                         uint8_t replyPayload) {
+  r.tx[0] = PROTO_V2_START;
+  r.tx[1] = len + 2;
+  r.tx[2] = ++s_sequence;
+  r.tx[3] = cmd;
+  memcpy(r.tx + 4, payload, len);
+  r.tx[4 + len] = crc8(r.tx + 1, len + 3);
+  r.txLen = len + PROTO_V2_OVERHEAD;
+  r.rxLen = replyPayload + PROTO_V2_OVERHEAD;
+}
+
+enum FrameState : uint8_t {
+  FRAME_OK = 0,
+  FRAME_NONE = 1,            // No frame at all (not ready, or not v2)
+  FRAME_CORRUPT = 2,         // Bad length or CRC
+  FRAME_STALE = 3            // Valid, but answers an earlier request
+};
+
+static FrameState readFrame(const I2cRequest &req, const uint8_t *rx, uint8_t len) {
+  if (len < PROTO_V2_OVERHEAD || rx[0] != PROTO_V2_START) return FRAME_NONE;
+  uint8_t body = rx[1];
+  if (body < 2 || body + 3 > len) return FRAME_CORRUPT;
+  if (crc8(rx + 1, body + 1) != rx[body + 2]) return FRAME_CORRUPT;
+  if (rx[2] != req.tx[2]) return FRAME_STALE;
+  return FRAME_OK;
+}
+
+// Payload of a reply frame already accepted by a framed check
+static const uint8_t* framePayload(const I2cResult &r, uint8_t &len) {
+  len = r.rx[1] - 2;
+  return r.rx + 4;
+}
+
+// ===================== RESPONSE CHECKS =================================
+// How each command's reply is judged by the I2C engine (see I2cVerdict)
+
+// WHOAMI: NUL-terminated UID, padded by the module; blank means no answer
+static I2cVerdict checkWhoami(const I2cRequest &req, const uint8_t *rx, uint8_t len,
+                              uint16_t &pollMs) {
+  (void)req;
+  (void)pollMs;
+  for (uint8_t i = 0; i < len && rx[i] != 0; ++i) {
+    if (!isspace(rx[i])) return I2C_ACCEPT;
   }
+  return I2C_RETRY;
+}
 
-  g_registry.logError(ERR_I2C_COMM, "WHOAMI failed after retries", String(addr));
-  return false;
+// GET_STOCK: little-endian u16
+static I2cVerdict checkStock(const I2cRequest &req, const uint8_t *rx, uint8_t len,
+                             uint16_t &pollMs) {
+  (void)req;
+  (void)pollMs;
+  (void)rx;
+  return len >= 2 ? I2C_ACCEPT : I2C_RETRY;
 }
 
-bool i2c_getStock(uint8_t addr, int &stock) {
-  for (int attempt = 0; attempt < I2C_MAX_RETRIES; ++attempt) {
-    Wire.beginTransmission(addr);
-    Wire.write(CMD_GET_STOCK);
-    int tx = Wire.endTransmission();
-    if (tx != 0) {
-      if (attempt < I2C_MAX_RETRIES - 1) delay(I2C_RETRY_DELAY_MS);
-      continue;
-    }
+// UPDATE_DISPLAY: poll until a byte arrives; anything but success is a NACK
+static I2cVerdict checkDisplayAck(const I2cRequest &req, const uint8_t *rx, uint8_t len,
+                                  uint16_t &pollMs) {
+  (void)req;
+  (void)pollMs;
+  if (len == 0) return I2C_KEEP_POLLING;
+  return rx[0] == CMD_ACK_SUCCESS ? I2C_ACCEPT : I2C_REJECT;
+}
 
-    delay(10);
-    Wire.requestFrom((int)addr, 2);
-    if (Wire.available() < 2) {
-      if (attempt < I2C_MAX_RETRIES - 1) {
-        delay(I2C_RETRY_DELAY_MS);
-        continue;
-      }
-      g_registry.logError(ERR_I2C_COMM, "GET_STOCK response incomplete", String(addr));
-      return false;
-    }
+// DISPENSE: other bytes just mean the motor is still running
+static I2cVerdict checkDispenseAck(const I2cRequest &req, const uint8_t *rx, uint8_t len,
+                                   uint16_t &pollMs) {
+  (void)req;
+  (void)pollMs;
+  if (len == 0) return I2C_KEEP_POLLING;
+  if (rx[0] == CMD_ACK_SUCCESS) return I2C_ACCEPT;
+  if (rx[0] == CMD_ACK_ERROR) return I2C_REJECT;
+  return I2C_KEEP_POLLING;
+}
 
-    uint8_t lo = Wire.read();
-    uint8_t hi = Wire.read();
-    stock = (int)hi << 8 | lo;
-    return true;
+// v2 STATUS. No frame at all means the module doesn't speak v2 (REJECT,
+// so discovery falls back to v1); a corrupted frame is retried.
+static I2cVerdict checkStatus(const I2cRequest &req, const uint8_t *rx, uint8_t len,
+                              uint16_t &pollMs) {
+  (void)pollMs;
+  switch (readFrame(req, rx, len)) {
+    case FRAME_NONE:    return I2C_REJECT;
+    case FRAME_CORRUPT: return I2C_RETRY;
+    case FRAME_STALE:   return I2C_KEEP_POLLING;
+    default: break;
   }
+  if (rx[3] != CMD_ACK_SUCCESS || rx[1] - 2 < STATUS_PAYLOAD_LEN) return I2C_REJECT;
+  return I2C_ACCEPT;
+}
 
-  g_registry.logError(ERR_I2C_COMM, "GET_STOCK failed after retries", String(addr));
-  return false;
+// v2 WHOAMI: UID as the payload
+static I2cVerdict checkFramedWhoami(const I2cRequest &req, const uint8_t *rx, uint8_t len,
+                                    uint16_t &pollMs) {
+  (void)pollMs;
+  switch (readFrame(req, rx, len)) {
+    case FRAME_OK:    break;
+    case FRAME_STALE: return I2C_KEEP_POLLING;
+    default:          return I2C_RETRY;
+  }
+  if (rx[3] != CMD_ACK_SUCCESS) return I2C_REJECT;
+  return rx[1] > 2 ? I2C_ACCEPT : I2C_RETRY;
 }
 
-bool i2c_updateDisplay(uint8_t addr, const String& name, int stock) {
-  // UPDATE_DISPLAY currently does not have an ACK from module; retry on transmission error
-  for (int attempt = 0; attempt < I2C_MAX_RETRIES; ++attempt) {
-    Wire.beginTransmission(addr);
-    Wire.write(CMD_UPDATE_DISPLAY);
-    uint8_t len = (uint8_t)name.length();
-    if (len > 20) len = 20;
-    Wire.write(len);
+// v2 UPDATE_DISPLAY / DISPENSE: poll until this request's ack arrives. A
+// PENDING ack may carry a u16 "retry after" in ms, which sets the next poll.
+static I2cVerdict checkFramedAck(const I2cRequest &req, const uint8_t *rx, uint8_t len,
+                                 uint16_t &pollMs) {
+  switch (readFrame(req, rx, len)) {
+    case FRAME_OK:      break;
+    case FRAME_CORRUPT: return I2C_RETRY;
+    default:            return I2C_KEEP_POLLING;
+  }
+  if (rx[3] == CMD_ACK_SUCCESS) return I2C_ACCEPT;
+  if (rx[3] == CMD_ACK_ERROR) return I2C_REJECT;
+  if (rx[1] - 2 >= 2) {
+    uint16_t retryAfter = (uint16_t)rx[4] | (uint16_t)rx[5] << 8;
+    if (retryAfter > 0) pollMs = retryAfter;
+  }
+  return I2C_KEEP_POLLING;   // CMD_ACK_PENDING
+}
 
-    for (int i = 0; i < len; i++) {
-      Wire.write(name[i]);
-    }
+// ===================== ADAPTIVE TIMING =================================
+// Each module keeps a reply-time histogram per command class (see
+// LatencyHistogram). Once it has LATENCY_MIN_SAMPLES, that module's
+// requests wait p99 x LATENCY_TIMEOUT_MARGIN for an answer and p50
+// between attempts, instead of the global I2C_RESPONSE_TIMEOUT and
+// I2C_RETRY_DELAY_MS. Only accepted replies are recorded, so failures
+// can't stretch the timeouts. A request that can't be resent (a v1
+// DISPENSE) never waits less than I2C_RESPONSE_TIMEOUT: running out of
+// time there means a lost sale, not a quick retry.
+
+static uint16_t clampMs(uint32_t ms, uint16_t lo, uint16_t hi) {
+  return ms < lo ? lo : ms > hi ? hi : (uint16_t)ms;
+}
 
-    Wire.write((uint8_t)(stock & 0xFF));
-    Wire.write((uint8_t)((stock >> 8) & 0xFF));
-
-    int tx = Wire.endTransmission();
-    if (tx == 0) {
-      // After sending the update, request an ACK byte from the module
-      delay(10);
-      unsigned long t0 = millis();
-      while (millis() - t0 < I2C_RESPONSE_TIMEOUT) {
-        Wire.requestFrom((int)addr, 1);
-        if (Wire.available()) {
-          uint8_t ack = Wire.read();
-          if (ack == CMD_ACK_SUCCESS) return true;
-          // module explicitly returned error
-          g_registry.logError(ERR_I2C_COMM, "UPDATE_DISPLAY module NACK", String(addr));
-          return false;
-        }
-        delay(10);
-      }
-      // No ACK received within timeout; treat as failure for this attempt
-    }
+static void adaptTiming(I2cRequest &r, LatencyClass cls) {
+  const ProductModule* mod = g_registry->findModuleByAddress(r.addr);
+  if (!mod) return;
+  const LatencyHistogram &h = mod->latency[cls];
+  if (h.samples() < LATENCY_MIN_SAMPLES) return;
+  uint16_t floorMs = r.idempotent ? I2C_TIMEOUT_MIN_MS : I2C_RESPONSE_TIMEOUT;
+  r.timeoutMs = clampMs(h.percentile(99) * LATENCY_TIMEOUT_MARGIN, floorMs, I2C_TIMEOUT_MAX_MS);
+  r.retryDelayMs = clampMs(h.percentile(50), I2C_RETRY_DELAY_MIN_MS, I2C_RETRY_DELAY_MS);
+}
+
+static void recordLatency(const I2cResult &r, LatencyClass cls) {
+  if (r.status != I2C_OK) return;
+  ProductModule* mod = g_registry->findModuleByAddress(r.addr);
+  if (mod) mod->latency[cls].record(r.responseMs);
+}
 
-    if (attempt < I2C_MAX_RETRIES - 1) delay(I2C_RETRY_DELAY_MS);
+// ===================== REQUEST BUILDERS ================================
+
+static I2cRequest whoamiRequest(uint8_t addr) {
+  I2cRequest r = i2cRequest(addr);
+  if (isFramed(addr)) {
+    frameRequest(r, CMD_WHOAMI, nullptr, 0, I2C_RX_MAX - PROTO_V2_OVERHEAD);
+    r.check = checkFramedWhoami;
+  } else {
+    r.tx[0] = CMD_WHOAMI;
+    r.txLen = 1;
+    r.rxLen = MODULE_UID_LEN;
+    r.check = checkWhoami;
   }
+  adaptTiming(r, LAT_WHOAMI);
+  return r;
+}
+
+// v1 only; v2 modules report stock in STATUS
+static I2cRequest stockRequest(uint8_t addr) {
+  I2cRequest r = i2cRequest(addr);
+  r.tx[0] = CMD_GET_STOCK;
+  r.txLen = 1;
+  r.rxLen = 2;
+  r.check = checkStock;
+  adaptTiming(r, LAT_POLL);
+  return r;
+}
+
+static I2cRequest statusRequest(uint8_t addr) {
+  I2cRequest r = i2cRequest(addr);
+  frameRequest(r, CMD_STATUS, nullptr, 0, STATUS_PAYLOAD_LEN);
+  r.check = checkStatus;
+  adaptTiming(r, LAT_POLL);
+  return r;
+}
+
+static I2cRequest displayRequest(uint8_t addr, const char* name, int stock) {
+  size_t nameLen = strlen(name);
+  uint8_t len = nameLen > 20 ? 20 : (uint8_t)nameLen;
+  uint8_t payload[23];
+  payload[0] = len;
+  memcpy(payload + 1, name, len);
+  payload[1 + len] = (uint8_t)(stock & 0xFF);
+  payload[2 + len] = (uint8_t)((stock >> 8) & 0xFF);
+
+  I2cRequest r = i2cRequest(addr);
+  if (isFramed(addr)) {
+    frameRequest(r, CMD_UPDATE_DISPLAY, payload, 3 + len, ACK_PAYLOAD_LEN);
+    r.check = checkFramedAck;
+  } else {
+    r.tx[0] = CMD_UPDATE_DISPLAY;
+    memcpy(r.tx + 1, payload, 3 + len);
+    r.txLen = 4 + len;
+    r.check = checkDisplayAck;
+  }
+  adaptTiming(r, LAT_DISPLAY);
+  return r;
+}
+
+// The motor takes a while: polls back off from I2C_DISPENSE_POLL_MS, follow
+// a v2 module's retry-after hint, and wait on the attention line where the
+// module and the board both have one
+static I2cRequest dispenseRequest(uint8_t addr) {
+  I2cRequest r = i2cRequest(addr);
+  if (isFramed(addr)) {
+    frameRequest(r, CMD_DISPENSE, nullptr, 0, ACK_PAYLOAD_LEN);
+    r.check = checkFramedAck;
+    r.attention = i2cHasAttention() && mapTest(s_attentionMap, addr);
+  } else {
+    r.tx[0] = CMD_DISPENSE;
+    r.txLen = 1;
+    r.check = checkDispenseAck;
+    // No sequence number to spot a repeat: a resend is a second vend
+    r.idempotent = false;
+  }
+  r.settleMs = 0;
+  r.pollMs = I2C_DISPENSE_POLL_MS;
+  r.pollMaxMs = I2C_DISPENSE_POLL_MAX_MS;
+  adaptTiming(r, LAT_DISPENSE);
+  return r;
+}
+
+// ===================== RESULT HANDLING =================================
+
+// Decoded v2 STATUS payload (layout in config.h)
+struct ModuleStatus {
+  uint32_t uidHash;
+  int stock;
+  uint8_t faults;
+  uint8_t version;
+  uint8_t caps;
+};
+
+static bool whoamiResult(const I2cResult &r, String &moduleUID) {
+  moduleUID = "";
+  if (r.status != I2C_OK) {
+    g_registry->logError(ERR_I2C_COMM, "WHOAMI failed after retries", r.addr);
+    return false;
+  }
+  recordLatency(r, LAT_WHOAMI);
+  // UIDs are printable, so a v1 reply never starts with PROTO_V2_START
+  const uint8_t *uid = r.rx;
+  uint8_t len = r.rxLen;
+  if (len >= PROTO_V2_OVERHEAD && r.rx[0] == PROTO_V2_START) uid = framePayload(r, len);
+  for (uint8_t i = 0; i < len && uid[i] != 0; ++i) moduleUID += (char)uid[i];
+  moduleUID.trim();
+  return true;
+}
+
+static bool stockResult(const I2cResult &r, int &stock) {
+  if (r.status != I2C_OK) {
+    g_registry->logError(ERR_I2C_COMM, "GET_STOCK failed after retries", r.addr);
+    return false;
+  }
+  recordLatency(r, LAT_POLL);
+  stock = (int)r.rx[1] << 8 | r.rx[0];
+  return true;
+}
+
+static bool statusResult(const I2cResult &r, ModuleStatus &st) {
+  if (r.status != I2C_OK) return false;
+  recordLatency(r, LAT_POLL);
+  uint8_t len;
+  const uint8_t *p = framePayload(r, len);
+  st.uidHash = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+  st.stock = (int)p[5] << 8 | p[4];
+  st.faults = p[6];
+  st.version = p[7];
+  st.caps = p[8];
+  return true;
+}
+
+static bool displayResult(const I2cResult &r) {
+  if (r.status == I2C_REJECTED) {
+    g_registry->logError(ERR_I2C_COMM, "UPDATE_DISPLAY module NACK", r.addr);
+  } else if (r.status != I2C_OK) {
+    g_registry->logError(ERR_I2C_COMM, "UPDATE_DISPLAY failed after retries", r.addr);
+  }
+  recordLatency(r, LAT_DISPLAY);
+  return r.status == I2C_OK;
+}
+
+// Failed attempts go in the ledger too (they are not uploaded)
+static void recordFailedDispense(uint8_t addr) {
+  ProductModule* mod = g_registry->findModuleByAddress(addr);
+  ledgerRecord(mod ? mod->itemCode : "", 0, false);
+}
+
+static bool dispenseResult(const I2cResult &r) {
+  uint8_t addr = r.addr;
+  if (r.status == I2C_REJECTED) {
+    g_registry->logError(ERR_DISPENSE_FAILED, "Module reported error", addr);
+    recordFailedDispense(addr);
+    return false;
+  }
+  if (r.status != I2C_OK) {
+    g_registry->logError(ERR_APP_TIMEOUT, "Dispense ACK timeout after retries", addr);
+    recordFailedDispense(addr);
+    // Never acknowledged: the module is off the bus until a health poll
+    // hears from it again
+    ProductModule* mod = g_registry->findModuleByAddress(addr);
+    if (r.status == I2C_NACK && mod && mod->online) {
+      g_registry->updateModuleHealth(addr, false);
+      g_registry->logError(ERR_MODULE_DISCONNECTED, "Module stopped answering", addr);
+      logErrorToSheets("Module disconnected", mod->moduleUID);
+    }
+    return false;
+  }
+  recordLatency(r, LAT_DISPENSE);
+
+  // Module reports successful dispense and is expected to have
+  // decremented its local stock. Controller now decrements the
+  // authoritative stock in Google Sheets and logs a transaction.
+  ProductModule* mod = g_registry->findModuleByAddress(addr);
+  if (mod && mod->itemCode[0]) {
+    ProductItem* p = g_registry->findProduct(mod->itemCode);
+    if (p) {
+      int newStock = p->stock - 1;
+      if (newStock < 0) newStock = 0;
+      // update local cache; Sheets writes are queued, not sent here
+      p->stock = newStock;
+      g_registry->updateModuleStock(addr, newStock);
+      updateStockInSheets(p->itemCode, newStock);
+      logTransactionToSheets(p->itemCode, 1);
+      // Push updated display back to module
+      if (i2c_updateDisplayAsync(addr, p->name, newStock)) mod->dirty = false;
+    }
+  }
+  return true;
+}
 
-  g_registry.logError(ERR_I2C_COMM, "UPDATE_DISPLAY failed after retries", String(addr));
-  return false;
+// ===================== ASYNC COMMANDS ==================================
+
+// A failed push leaves the module dirty for the next syncModuleDisplays()
+static void displayDone(const I2cResult &r, void *ctx) {
+  (void)ctx;
+  if (displayResult(r)) return;
+  ProductModule* mod = g_registry->findModuleByAddress(r.addr);
+  if (mod) mod->dirty = true;
+}
+
+bool i2c_updateDisplayAsync(uint8_t addr, const char* name, int stock) {
+  I2cRequest r = displayRequest(addr, name, stock);
+  r.done = displayDone;
+  return i2cSubmit(r);
+}
+
+static void stockDone(const I2cResult &r, void *ctx) {
+  (void)ctx;
+  int stock;
+  bool ok = stockResult(r, stock);
+  g_registry->updateModuleHealth(r.addr, ok);
+  if (ok) g_registry->updateModuleStock(r.addr, stock);
+}
+
+static void statusDone(const I2cResult &r, void *ctx) {
+  (void)ctx;
+  ModuleStatus st;
+  bool ok = statusResult(r, st);
+  if (!ok) g_registry->logError(ERR_I2C_COMM, "STATUS failed after retries", r.addr);
+  g_registry->updateModuleHealth(r.addr, ok);
+  if (ok) g_registry->updateModuleStock(r.addr, st.stock);
+}
+
+bool i2c_getStockAsync(uint8_t addr) {
+  I2cRequest r = isFramed(addr) ? statusRequest(addr) : stockRequest(addr);
+  r.done = isFramed(addr) ? statusDone : stockDone;
+  return i2cSubmit(r);
 }
 
-bool i2c_dispense(uint8_t addr) {
-  // Perform up to N attempts to request a dispense and receive an ACK
-  for (int attempt = 0; attempt < I2C_MAX_RETRIES; ++attempt) {
-    Wire.beginTransmission(addr);
-    Wire.write(CMD_DISPENSE);
-    int tx = Wire.endTransmission();
-    if (tx != 0) {
-      // transmission failed, retry
-      if (attempt < I2C_MAX_RETRIES - 1) delay(I2C_RETRY_DELAY_MS);
-      continue;
+// One dispense at a time: there is one customer at the keypad
+static bool s_dispensing = false;
+static DispenseCallback s_dispenseDone = nullptr;
+
+static void dispenseDone(const I2cResult &r, void *ctx) {
+  (void)ctx;
+  DispenseCallback done = s_dispenseDone;
+  s_dispensing = false;
+  s_dispenseDone = nullptr;
+  bool ok = dispenseResult(r);
+  if (done) done(ok);
+}
+
+bool i2c_dispenseAsync(uint8_t addr, DispenseCallback done) {
+  if (s_dispensing) return false;
+  I2cRequest r = dispenseRequest(addr);
+  r.done = dispenseDone;
+  if (!i2cSubmit(r)) return false;
+  s_dispensing = true;
+  s_dispenseDone = done;
+  return true;
+}
+
+// ===================== MODULE DISCOVERY ==============================
+// Boot probes only the addresses modules answered at last time (saved in
+// LittleFS), so startup scales with the modules actually installed. The
+// rest of the range is swept in the background from loop(), a couple of
+// requests at a time, with WHOAMI and display pushes queued on the I2C
+// engine alongside the sweep's probes and any customer traffic.
+// Each probe is a v2 STATUS request, which also negotiates the protocol:
+// a v2 module whose UID hash matches a known module is identified by the
+// probe alone; anything else that answers is asked WHOAMI (v1 if the
+// STATUS reply wasn't a v2 frame).
+
+static uint8_t s_knownMap[ADDRESS_MAP_BYTES];    // From the last sweep
+static uint8_t s_seenMap[ADDRESS_MAP_BYTES];     // Devices that answered this boot
+static uint8_t s_pendingMap[ADDRESS_MAP_BYTES];  // Still to probe
+static uint8_t s_discoveryInFlight = 0;
+static bool s_sweeping = false;
+
+static void loadAddressMap() {
+  memset(s_knownMap, 0, sizeof(s_knownMap));
+  if (mountStorage() && LittleFS.exists(I2C_ADDRESS_MAP_PATH)) {
+    File f = LittleFS.open(I2C_ADDRESS_MAP_PATH, "r");
+    if (f) {
+      if (f.read(s_knownMap, sizeof(s_knownMap)) != sizeof(s_knownMap)) memset(s_knownMap, 0, sizeof(s_knownMap));
+      f.close();
     }
+  }
+  // Warm-boot snapshot addresses count as known too
+  for (auto& module : g_registry->getModules()) {
+    if (module.i2cAddress < 128) mapSet(s_knownMap, module.i2cAddress, true);
+  }
+}
 
-    // Wait for acknowledgment with timeout
-    unsigned long start = millis();
-    while (millis() - start < I2C_RESPONSE_TIMEOUT) {
-      Wire.requestFrom((int)addr, 1);
-      if (Wire.available()) {
-        uint8_t ack = Wire.read();
-        if (ack == CMD_ACK_SUCCESS) {
-          // Module reports successful dispense and is expected to have
-          // decremented its local stock. Controller now decrements the
-          // authoritative stock in Google Sheets and logs a transaction.
-          ProductModule* mod = g_registry.findModuleByAddress(addr);
-          if (mod && mod->itemCode.length() > 0) {
-            ProductItem* p = g_registry.findProduct(mod->itemCode);
-            if (p) {
-              int newStock = p->stock - 1;
-              if (newStock < 0) newStock = 0;
-              // update local cache and Sheets
-              p->stock = newStock;
-              g_registry.updateModuleStock(addr, newStock);
-              updateStockInSheets(p->itemCode, newStock);
-              logTransactionToSheets(p->itemCode, 1);
-              // Optionally push updated display back to module
-              i2c_updateDisplay(addr, p->name, newStock);
-            }
-          }
-          return true;
-        }
-        if (ack == CMD_ACK_ERROR) {
-          g_registry.logError(ERR_DISPENSE_FAILED, "Module reported error", String(addr));
-          return false;
-        }
+static void saveAddressMap() {
+  if (memcmp(s_knownMap, s_seenMap, sizeof(s_seenMap)) == 0) return;
+  if (!mountStorage()) return;
+  File f = LittleFS.open(I2C_ADDRESS_MAP_PATH, "w");
+  if (!f) return;
+  f.write(s_seenMap, sizeof(s_seenMap));
+  f.close();
+  memcpy(s_knownMap, s_seenMap, sizeof(s_knownMap));
+}
+
+// A module answered WHOAMI at `addr`: bring the registry up to date and
+// queue its display push
+static void onModuleFound(uint8_t addr, const String& moduleUID) {
+  Serial.print("Module at 0x");
+  Serial.print(addr, HEX);
+  Serial.print(" UID: ");
+  Serial.print(moduleUID);
+  Serial.println(isFramed(addr) ? " (v2)" : " (v1)");
+  mapSet(s_seenMap, addr, true);
+
+  // Check registry (which was seeded from Sheets) for this UID
+  ProductModule* sheetModule = g_registry->findModuleByUID(moduleUID);
+  if (!sheetModule) {
+    // Not present in Sheets: add and register so operator can assign product later
+    Serial.println("  Module UID not found in Sheets; registering new module");
+    g_registry->addModule(addr, moduleUID.c_str(), "", 0);
+    registerNewModuleToSheets(moduleUID, addr);
+  } else {
+    // Ensure registry reflects the currently-scanned I2C address
+    g_registry->setModuleAddress(sheetModule, addr);
+    sheetModule->online = true;
+    sheetModule->lastSeen = millis();
+
+    // If a product code is assigned in Modules sheet, push the product
+    if (sheetModule->itemCode[0]) {
+      ProductItem* prod = g_registry->findProduct(sheetModule->itemCode);
+      if (prod) {
+        // Update the module entry with authoritative values, then queue
+        // the product name and stock for its display
+        g_registry->addModule(addr, moduleUID.c_str(), prod->itemCode, prod->stock);
+        ProductModule* mod = g_registry->findModuleByAddress(addr);
+        if (i2c_updateDisplayAsync(addr, prod->name, prod->stock) && mod) mod->dirty = false;
+      } else {
+        Serial.println("  Product code assigned to module not found in Products sheet");
+        g_registry->logError(ERR_INVALID_PRODUCT, "Product code not found in Products sheet", sheetModule->itemCode);
       }
-      delay(50);
+    } else {
+      Serial.println("  Module has no product code assigned in Sheets");
     }
+  }
+  g_registry->updateModuleHealth(addr, true);
+}
+
+static void whoamiDone(const I2cResult &r, void *ctx) {
+  (void)ctx;
+  --s_discoveryInFlight;
+  String moduleUID;
+  if (whoamiResult(r, moduleUID)) onModuleFound(r.addr, moduleUID);
+  else g_registry->updateModuleHealth(r.addr, false);
+}
+
+static void askWhoami(uint8_t addr) {
+  I2cRequest req = whoamiRequest(addr);
+  req.done = whoamiDone;
+  if (i2cSubmit(req)) return;   // Stays in flight
+  mapSet(s_pendingMap, addr, true);   // Queue full: probe it again later
+  --s_discoveryInFlight;
+}
 
-    // ACK timeout for this attempt; retry if attempts remain
-    if (attempt < I2C_MAX_RETRIES - 1) {
-      delay(I2C_RETRY_DELAY_MS);
-      continue;
+// STATUS probe answered (or not). NACK means nothing is there.
+static void probeDone(const I2cResult &r, void *ctx) {
+  (void)ctx;
+  ModuleStatus st;
+  if (statusResult(r, st)) {
+    mapSet(s_framedMap, r.addr, true);
+    mapSet(s_attentionMap, r.addr, st.caps & MODULE_CAP_ATTENTION);
+    mapSet(s_fastMap, r.addr, st.caps & (MODULE_CAP_FAST | MODULE_CAP_FAST_PLUS));
+    mapSet(s_fastPlusMap, r.addr, st.caps & MODULE_CAP_FAST_PLUS);
+    ProductModule* known = g_registry->findModuleByUIDHash(st.uidHash);
+    if (!known) {
+      askWhoami(r.addr);
+      return;
     }
+    String moduleUID = known->moduleUID;
+    --s_discoveryInFlight;
+    onModuleFound(r.addr, moduleUID);
+    ProductModule* mod = g_registry->findModuleByAddress(r.addr);
+    if (mod) mod->healthy = st.faults == 0;
+    return;
   }
+  mapSet(s_framedMap, r.addr, false);
+  mapSet(s_attentionMap, r.addr, false);
+  mapSet(s_fastMap, r.addr, false);
+  mapSet(s_fastPlusMap, r.addr, false);
+  if (r.status == I2C_NACK) {
+    --s_discoveryInFlight;
+    return;
+  }
+  // Answered, but not in v2. Whatever it is, it shares the bus, so it
+  // holds the clock at standard even if it turns out not to be a module.
+  mapSet(s_seenMap, r.addr, true);
+  askWhoami(r.addr);
+}
 
-  g_registry.logError(ERR_APP_TIMEOUT, "Dispense ACK timeout after retries", String(addr));
-  return false;
+// One STATUS attempt, no retries: absent addresses cost a single NACKed write
+static bool submitProbe(uint8_t addr) {
+  I2cRequest req = statusRequest(addr);
+  req.attempts = 1;
+  req.probe = true;
+  req.done = probeDone;
+  if (!i2cSubmit(req)) return false;
+  ++s_discoveryInFlight;
+  return true;
 }
 
-// ===================== MODULE DISCOVERY ==============================
+// Fastest clock that every device that answered, and the LCD, supports.
+// Held at standard while a sweep may still turn up slower devices.
+static void updateBusClock() {
+  if (s_sweeping) {
+    i2cSetClockTarget(I2C_CLOCK_STANDARD);
+    return;
+  }
+  uint32_t hz = LCD_I2C_MAX_HZ;
+  for (uint8_t addr = I2C_MIN_ADDR; addr <= I2C_MAX_ADDR; ++addr) {
+    if (!mapTest(s_seenMap, addr)) continue;
+    uint32_t device = mapTest(s_fastPlusMap, addr) ? I2C_CLOCK_FAST_PLUS
+                    : mapTest(s_fastMap, addr) ? I2C_CLOCK_FAST : I2C_CLOCK_STANDARD;
+    if (device < hz) hz = device;
+  }
+  i2cSetClockTarget(hz);
+}
 
-void discoverProductModules() {
-  Serial.println("Scanning I2C bus for product modules...");
+// Probe `addr` again from the background sweep, e.g. after a module swap.
+// The new device may be slower, so the clock drops until the sweep ends.
+static void rediscover(uint8_t addr) {
+  mapSet(s_pendingMap, addr, true);
+  s_sweeping = true;
+  updateBusClock();
+}
 
-  // Ensure we have the latest product & module mapping from Sheets
-  syncProductDataFromSheets();
+void discoverProductModules() {
+  // The registry already holds the catalog (warm-boot snapshot or a
+  // fresh sync, see setup()); scan results are matched against it
+  loadAddressMap();
+  memset(s_seenMap, 0, sizeof(s_seenMap));
+  memset(s_pendingMap, 0, sizeof(s_pendingMap));
+  for (uint8_t addr = I2C_MIN_ADDR; addr <= I2C_MAX_ADDR; ++addr) {
+    if (addr != LCD_I2C_ADDR) mapSet(s_pendingMap, addr, true);
+  }
 
+  Serial.println("Probing last-known module addresses...");
   for (uint8_t addr = I2C_MIN_ADDR; addr <= I2C_MAX_ADDR; ++addr) {
-    if (addr == 0x27) continue; // Skip LCD address
-
-    Wire.beginTransmission(addr);
-    uint8_t err = Wire.endTransmission();
-
-    if (err == 0) {
-      Serial.print("Found device at 0x");
-      Serial.println(addr, HEX);
-
-      String moduleUID;
-      if (i2c_whoami(addr, moduleUID)) {
-        Serial.print("  Module UID: ");
-        Serial.println(moduleUID);
-
-        // Check registry (which was seeded from Sheets) for this UID
-        ProductModule* sheetModule = g_registry.findModuleByUID(moduleUID);
-        if (!sheetModule) {
-          // Not present in Sheets: add and register so operator can assign product later
-          Serial.println("  Module UID not found in Sheets; registering new module");
-          g_registry.addModule(addr, moduleUID, "", "New Module", 0);
-          registerNewModuleToSheets(moduleUID, addr);
-        } else {
-          // Ensure registry reflects the currently-scanned I2C address
-          sheetModule->i2cAddress = addr;
-          sheetModule->online = true;
-          sheetModule->lastSeen = millis();
-
-          // If a product code is assigned in Modules sheet, push the product
-          if (sheetModule->itemCode.length() > 0) {
-            ProductItem* prod = g_registry.findProduct(sheetModule->itemCode);
-            if (prod) {
-              // Send product name and stock to module using existing helper
-              i2c_updateDisplay(addr, prod->name, prod->stock);
-              // Update the module entry with authoritative values
-              g_registry.addModule(addr, moduleUID, prod->itemCode, prod->name, prod->stock);
-            } else {
-              Serial.println("  Product code assigned to module not found in Products sheet");
-              g_registry.logError(ERR_INVALID_PRODUCT, "Product code not found in Products sheet", sheetModule->itemCode);
-            }
-          } else {
-            Serial.println("  Module has no product code assigned in Sheets");
-          }
-        }
-        g_registry.updateModuleHealth(addr, true);
-      } else {
-        g_registry.updateModuleHealth(addr, false);
-      }
+    if (!mapTest(s_knownMap, addr) || !mapTest(s_pendingMap, addr)) continue;
+    while (!submitProbe(addr)) {
+      i2cService();
+      yield();
     }
+    mapSet(s_pendingMap, addr, false);
+  }
+  while (s_discoveryInFlight > 0) {
+    i2cService();
+    yield();
   }
 
-  // After scanning and updating modules, attempt a local reconcile
   matchModulesToSheets();
-  g_registry.debugPrintModules();
+  s_sweeping = true;
+  Serial.println("Known modules probed; sweeping the rest of the bus in the background");
+}
+
+void tickDiscovery() {
+  if (!s_sweeping) return;
+  uint8_t addr = I2C_MIN_ADDR;
+  while (s_discoveryInFlight < I2C_SWEEP_INFLIGHT && addr <= I2C_MAX_ADDR) {
+    if (mapTest(s_pendingMap, addr)) {
+      if (!submitProbe(addr)) return;   // Engine queue full; next loop
+      mapSet(s_pendingMap, addr, false);
+    }
+    ++addr;
+  }
+  if (s_discoveryInFlight > 0 || addr <= I2C_MAX_ADDR) return;
+
+  // Nothing pending and nothing in flight: the sweep is done
+  s_sweeping = false;
+  saveAddressMap();
+  updateBusClock();
+  matchModulesToSheets();
+  syncModuleDisplays();
+  g_registry->debugPrintModules();
   Serial.println("Module discovery complete");
 }
 
+bool discoveryRunning() {
+  return s_sweeping;
+}
+
 void matchModulesToSheets() {
   // After `syncProductDataFromSheets()` has run, modules whose I2C address
-  // matched a row in the Products sheet will already have `itemCode`/`name`
+  // matched a row in the Products sheet will already have `itemCode`
   // populated. This helper performs a best-effort local reconcile: if a
-  // module already has an `itemCode`, ensure the module's name/stock mirror
-  // the registered product data in the local registry.
-  for (auto& module : g_registry.getModules()) {
-    if (module.itemCode.length() == 0) continue;
-    ProductItem* product = g_registry.findProduct(module.itemCode);
+  // module already has an `itemCode`, ensure the module's stock mirrors
+  // the registered product data in the local registry. (Names are read
+  // from the catalog on demand; see ProductRegistry::moduleName().)
+  // A module whose product changed is marked dirty for its display.
+  for (auto& module : g_registry->getModules()) {
+    if (!module.itemCode[0]) continue;
+    ProductItem* product = g_registry->findProduct(module.itemCode);
     if (product) {
-      module.name = product->name;
+      if (product->dirty || module.stock != product->stock) module.dirty = true;
       module.stock = product->stock;
     }
   }
+  for (auto& product : g_registry->getProducts()) product.dirty = false;
 }
 
 void syncModuleDisplays() {
-  // Update all module OLEDs with current product data
-  for (auto& module : g_registry.getModules()) {
-    if (module.online && !module.itemCode.startsWith("NEW")) {
-      i2c_updateDisplay(module.i2cAddress, module.name, module.stock);
+  // Queue updates for module OLEDs whose name or stock changed since the
+  // last push; after a quiet sync this sends nothing. A push that fails
+  // (or doesn't fit in the queue) leaves the module dirty for next time.
+  for (auto& module : g_registry->getModules()) {
+    if (!module.dirty || !module.online) continue;
+    if (strncmp(module.itemCode, "NEW", 3) == 0) continue;
+    if (i2c_updateDisplayAsync(module.i2cAddress, g_registry->moduleName(module), module.stock)) {
+      module.dirty = false;
+    }
+  }
+}
+
+// ===================== HEALTH POLLER =================================
+// One module at a time, round-robin, so a full pass over the bus takes
+// HEALTH_CYCLE_MS however many modules there are. Each poll is a single
+// attempt (STATUS for v2 modules, GET_STOCK for v1); an unanswered poll
+// counts as a miss rather than being retried, and HEALTH_MISS_LIMIT misses
+// in a row take the module offline.
+
+static size_t s_healthNext = 0;           // Round-robin cursor into modules
+static unsigned long s_healthDueAt = 0;   // Next poll not before this
+
+static void healthMissed(ProductModule &mod) {
+  if (mod.missStreak < 255) ++mod.missStreak;
+  if (mod.missStreak < HEALTH_MISS_LIMIT || !mod.online) return;
+
+  g_registry->updateModuleHealth(mod.i2cAddress, false);
+  g_registry->logError(ERR_MODULE_DISCONNECTED, "Module stopped answering", mod.i2cAddress);
+  logErrorToSheets("Module disconnected", mod.moduleUID);
+}
+
+// A poll was answered: latency, stock, and the display of a module that
+// has just come back
+static void healthAnswered(ProductModule &mod, const I2cResult &r, int stock) {
+  // Smoothed reply time (1/4 weight to the new sample)
+  uint16_t sample = r.responseMs > 0xFFFF ? 0xFFFF : (uint16_t)r.responseMs;
+  mod.latencyMs = mod.latencyMs ? (uint16_t)((3UL * mod.latencyMs + sample) / 4) : sample;
+  mod.missStreak = 0;
+
+  bool reconnected = !mod.online;
+  g_registry->updateModuleHealth(r.addr, true);
+  g_registry->updateModuleStock(r.addr, stock);
+  if (!reconnected) return;
+
+  Serial.print("Module 0x"); Serial.print(r.addr, HEX); Serial.println(" back online");
+  if (mod.itemCode[0] && strncmp(mod.itemCode, "NEW", 3) != 0 &&
+      i2c_updateDisplayAsync(r.addr, g_registry->moduleName(mod), mod.stock)) {
+    mod.dirty = false;
+  }
+}
+
+static void healthStockDone(const I2cResult &r, void *ctx) {
+  (void)ctx;
+  ProductModule* mod = g_registry->findModuleByAddress(r.addr);
+  if (!mod) return;   // Gone in a registry swap
+  if (r.status != I2C_OK) healthMissed(*mod);
+  else healthAnswered(*mod, r, (int)r.rx[1] << 8 | r.rx[0]);
+}
+
+static void healthStatusDone(const I2cResult &r, void *ctx) {
+  (void)ctx;
+  ProductModule* mod = g_registry->findModuleByAddress(r.addr);
+  if (!mod) return;
+  ModuleStatus st;
+  if (!statusResult(r, st)) {
+    if (r.status != I2C_REJECTED) {
+      healthMissed(*mod);
+      return;
     }
+    // Answered, but no longer in v2: renegotiate
+    mapSet(s_framedMap, r.addr, false);
+    mapSet(s_attentionMap, r.addr, false);
+    mapSet(s_fastMap, r.addr, false);
+    mapSet(s_fastPlusMap, r.addr, false);
+    rediscover(r.addr);
+    return;
+  }
+  if (st.uidHash != HashIndex::hashOf(mod->moduleUID)) {
+    // A different module now answers at this address
+    g_registry->logError(ERR_MODULE_UID_MISMATCH, "Module at address was replaced", r.addr);
+    g_registry->updateModuleHealth(r.addr, false);
+    rediscover(r.addr);
+    return;
   }
+  bool healthy = st.faults == 0;
+  if (mod->healthy && !healthy) {
+    g_registry->logError(ERR_DISPENSE_FAILED, "Module reports a mechanism fault", r.addr);
+  }
+  mod->healthy = healthy;
+  healthAnswered(*mod, r, st.stock);
 }
 
 void checkModuleHealth() {
-  // Poll all known modules to verify they're still online
-  for (auto& module : g_registry.getModules()) {
-    int stock;
-    bool ok = i2c_getStock(module.i2cAddress, stock);
-    g_registry.updateModuleHealth(module.i2cAddress, ok);
-    
-    if (ok) {
-      g_registry.updateModuleStock(module.i2cAddress, stock);
+  unsigned long now = millis();
+  if ((long)(now - s_healthDueAt) < 0) return;
+
+  auto& modules = g_registry->getModules();
+  if (modules.empty()) {
+    s_healthDueAt = now + HEALTH_CYCLE_MS;
+    return;
+  }
+  unsigned long interval = HEALTH_CYCLE_MS / modules.size();
+  unsigned long started = micros();
+
+  for (uint8_t polls = 0; polls < HEALTH_POLLS_PER_TICK; ++polls) {
+    if ((long)(now - s_healthDueAt) < 0) break;
+    if (micros() - started >= HEALTH_TICK_BUDGET_US) break;
+    // Leave the bus to dispenses and display pushes when they queue up
+    if (i2cPending() >= HEALTH_MAX_QUEUED) break;
+
+    if (s_healthNext >= modules.size()) s_healthNext = 0;
+    ProductModule& mod = modules[s_healthNext++];
+    if (!i2cBusy(mod.i2cAddress)) {
+      bool framed = isFramed(mod.i2cAddress);
+      I2cRequest r = framed ? statusRequest(mod.i2cAddress) : stockRequest(mod.i2cAddress);
+      r.attempts = 1;
+      r.probe = !mod.online;   // NACKs from a module already offline aren't bus errors
+      r.done = framed ? healthStatusDone : healthStockDone;
+      if (!i2cSubmit(r)) break;
     }
+    s_healthDueAt += interval;
   }
+
+  // Fell behind (boot, long sync): restart the schedule rather than burst
+  if ((long)(now - s_healthDueAt) > (long)HEALTH_CYCLE_MS) s_healthDueAt = now;
 }
 
 ProductModule* getModuleByAddress(uint8_t addr) {
-  return g_registry.findModuleByAddress(addr);
+  return g_registry->findModuleByAddress(addr);
 }
 
 ProductModule* getModuleByCode(const String& code) {
-  return g_registry.findModuleByCode(code);
+  return g_registry->findModuleByCode(code);
 }
 
 void updateModuleStock(uint8_t addr, int newStock) {
-  g_registry.updateModuleStock(addr, newStock);
+  g_registry->updateModuleStock(addr, newStock);
 }
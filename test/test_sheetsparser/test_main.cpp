@@ -0,0 +1,259 @@
+#include <Arduino.h>
+#include <unity.h>
+
+#include <sheetsparser.h>
+
+// ===================== FIXTURES ======================================
+
+static const char FULL_BODY[] =
+  "{\"spreadsheetId\":\"x\",\"valueRanges\":["
+  "{\"range\":\"Products!A2:D4\",\"majorDimension\":\"ROWS\","
+  "\"values\":[[\"A1\",\"Chips\",\"5\",\"0x10\"],[\"A2\",\"Soda\",\"3\",\"0x11\"]]},"
+  "{\"range\":\"Modules!A2:C3\",\"majorDimension\":\"ROWS\","
+  "\"values\":[[\"UID1\",\"0x10\",\"A1\"]]}"
+  "]}\n";
+
+// Rows seen by the parser, flattened to "range:index:cell|cell|..." so a
+// whole response compares as one string
+#define SEEN_MAX 512
+
+struct Seen {
+  uint16_t rows;
+  size_t len;
+  char text[SEEN_MAX];
+};
+
+static Seen s_seen;
+
+static void seenAppend(const char *p, size_t n) {
+  if (s_seen.len + n >= SEEN_MAX) n = SEEN_MAX - 1 - s_seen.len;
+  memcpy(s_seen.text + s_seen.len, p, n);
+  s_seen.len += n;
+  s_seen.text[s_seen.len] = '\0';
+}
+
+static void recordRow(const SheetsRow &row, void *ctx) {
+  (void)ctx;
+  char head[16];
+  snprintf(head, sizeof(head), "%u:%u:", (unsigned)row.range, (unsigned)row.index);
+  seenAppend(head, strlen(head));
+  for (uint8_t i = 0; i < row.count; ++i) {
+    if (i) seenAppend("|", 1);
+    seenAppend(row.cells[i].ptr, row.cells[i].len);
+  }
+  seenAppend(";", 1);
+  ++s_seen.rows;
+}
+
+static void clearSeen() {
+  memset(&s_seen, 0, sizeof(s_seen));
+}
+
+// Feed `len` bytes of `body` in `chunk`-sized pieces the way
+// streamSheetsGet does, carrying the unconsumed tail forward
+static size_t feed(SheetsValuesParser &parser, const char *body, size_t len, size_t chunk) {
+  static char buf[128];
+  size_t fill = 0, sent = 0;
+  while (sent < len) {
+    size_t n = len - sent;
+    if (n > chunk) n = chunk;
+    if (n > sizeof(buf) - fill) n = sizeof(buf) - fill;
+    memcpy(buf + fill, body + sent, n);
+    sent += n;
+    fill += n;
+    size_t consumed = parser.parse(buf, fill);
+    memmove(buf, buf + consumed, fill - consumed);
+    fill -= consumed;
+  }
+  return fill;
+}
+
+// Parse a whole response in one call; `body` is copied since the parser
+// decodes in place
+static SheetsValuesParser &parseAll(const char *body) {
+  static char buf[256];
+  static SheetsValuesParser parser(recordRow, nullptr);
+  clearSeen();
+  parser.reset();
+  size_t len = strlen(body);
+  memcpy(buf, body, len);
+  parser.parse(buf, len);
+  return parser;
+}
+
+static CellView view(const char *s) {
+  CellView v = { s, (uint16_t)strlen(s) };
+  return v;
+}
+
+// ===================== TOKENIZER =====================================
+
+static void test_string_escapes_decode_in_place() {
+  SheetsValuesParser &parser = parseAll(
+    "{\"values\":[[\"a\\\"b\",\"c\\\\d\",\"x\\/y\",\"t\\tn\\n\"]]}");
+  TEST_ASSERT_FALSE(parser.failed());
+  TEST_ASSERT_EQUAL_STRING("0:0:a\"b|c\\d|x/y|t\tn\n;", s_seen.text);
+}
+
+static void test_unicode_escapes_become_utf8() {
+  // U+00E9, U+20AC, and U+1F600 as a surrogate pair
+  parseAll("{\"values\":[[\"caf\\u00e9\",\"\\u20AC\",\"\\ud83d\\ude00\"]]}");
+  TEST_ASSERT_EQUAL_STRING("0:0:caf\xC3\xA9|\xE2\x82\xAC|\xF0\x9F\x98\x80;", s_seen.text);
+}
+
+static void test_bad_unicode_escape_is_replaced() {
+  parseAll("{\"values\":[[\"a\\uZZZZb\"]]}");
+  TEST_ASSERT_EQUAL_STRING("0:0:a?ZZZZb;", s_seen.text);
+}
+
+static void test_numbers_booleans_and_null() {
+  parseAll("{\"values\":[[12,-3.5,true,null,\"7\"]]}");
+  TEST_ASSERT_EQUAL_STRING("0:0:12|-3.5|true||7;", s_seen.text);
+}
+
+static void test_empty_rows_keep_their_index() {
+  parseAll("{\"values\":[[],[\"a\"],[ ],[\"b\"]]}");
+  TEST_ASSERT_EQUAL(4, s_seen.rows);
+  TEST_ASSERT_EQUAL_STRING("0:0:;0:1:a;0:2:;0:3:b;", s_seen.text);
+}
+
+static void test_brackets_and_commas_inside_strings() {
+  parseAll("{\"values\":[[\"[x]\",\"{y}\",\",\",\"\\\"]\"]]}");
+  TEST_ASSERT_EQUAL_STRING("0:0:[x]|{y}|,|\"];", s_seen.text);
+}
+
+static void test_extra_cells_are_dropped() {
+  parseAll("{\"values\":[[\"1\",\"2\",\"3\",\"4\",\"5\",\"6\",\"7\",\"8\",\"9\",\"10\"],[\"next\"]]}");
+  TEST_ASSERT_EQUAL_STRING("0:0:1|2|3|4|5|6|7|8;0:1:next;", s_seen.text);
+}
+
+// A range with no data has no "values" key at all; the next range's rows
+// must still be numbered as range 1
+static void test_empty_range_keeps_range_numbering() {
+  SheetsValuesParser &parser = parseAll(
+    "{\"valueRanges\":["
+    "{\"range\":\"Products!A2:D\",\"majorDimension\":\"ROWS\"},"
+    "{\"range\":\"Modules!A2:C3\",\"majorDimension\":\"ROWS\",\"values\":[[\"UID1\"]]}"
+    "]}");
+  TEST_ASSERT_EQUAL(2, parser.rangesSeen());
+  TEST_ASSERT_EQUAL_STRING("1:0:UID1;", s_seen.text);
+}
+
+static void test_unbalanced_close_fails() {
+  SheetsValuesParser &parser = parseAll("{\"values\":[]}]");
+  TEST_ASSERT_TRUE(parser.failed());
+}
+
+// Every split point must give the same rows as a single pass, including
+// splits inside escapes, numbers and surrogate pairs
+static void test_chunk_boundaries_do_not_change_rows() {
+  static const char BODY[] =
+    "{\"valueRanges\":["
+    "{\"range\":\"P\"},"
+    "{\"range\":\"M\",\"values\":[[\"a\\\"[b]\",12345,null],[],"
+    "[\"\\ud83d\\ude00\",\"c\\\\\",true]]}"
+    "]}";
+  parseAll(BODY);
+  char expected[SEEN_MAX];
+  strcpy(expected, s_seen.text);
+
+  for (size_t chunk = 1; chunk <= sizeof(BODY); ++chunk) {
+    clearSeen();
+    SheetsValuesParser parser(recordRow, nullptr);
+    size_t left = feed(parser, BODY, sizeof(BODY) - 1, chunk);
+    TEST_ASSERT_FALSE(parser.failed());
+    TEST_ASSERT_TRUE(parser.complete());
+    TEST_ASSERT_EQUAL(0, left);
+    TEST_ASSERT_EQUAL_STRING(expected, s_seen.text);
+  }
+}
+
+// ===================== CELL VIEWS ====================================
+
+static void test_toLong_is_decimal() {
+  TEST_ASSERT_EQUAL(42, view(" 42 ").toLong());
+  TEST_ASSERT_EQUAL(10, view("010").toLong());
+  TEST_ASSERT_EQUAL(0, view("0x10").toLong());
+  TEST_ASSERT_EQUAL(-7, view("x").toLong(-7));
+}
+
+static void test_toAddress_accepts_decimal_and_hex() {
+  uint8_t addr = 0;
+  TEST_ASSERT_TRUE(view("0x21").toAddress(addr));
+  TEST_ASSERT_EQUAL(0x21, addr);
+  TEST_ASSERT_TRUE(view(" 33 ").toAddress(addr));
+  TEST_ASSERT_EQUAL(33, addr);
+  TEST_ASSERT_FALSE(view("none").toAddress(addr));
+}
+
+// ===================== TRUNCATION ====================================
+
+static void test_full_body_is_complete() {
+  clearSeen();
+  SheetsValuesParser parser(recordRow, nullptr);
+  size_t left = feed(parser, FULL_BODY, strlen(FULL_BODY), 16);
+  TEST_ASSERT_FALSE(parser.failed());
+  TEST_ASSERT_TRUE(parser.complete());
+  TEST_ASSERT_EQUAL(0, left);
+  TEST_ASSERT_EQUAL(3, s_seen.rows);
+  TEST_ASSERT_EQUAL(2, parser.rangesSeen());
+}
+
+// Cut off between rows: every delivered row parses cleanly and nothing is
+// left over, so only the completeness check can tell it apart
+static void test_truncated_between_rows_is_incomplete() {
+  const char *cut = strstr(FULL_BODY, ",[\"A2\"");
+  clearSeen();
+  SheetsValuesParser parser(recordRow, nullptr);
+  size_t left = feed(parser, FULL_BODY, cut - FULL_BODY, 16);
+  TEST_ASSERT_FALSE(parser.failed());
+  TEST_ASSERT_EQUAL(0, left);
+  TEST_ASSERT_EQUAL(1, s_seen.rows);
+  TEST_ASSERT_FALSE(parser.complete());
+}
+
+static void test_truncated_mid_row_is_incomplete() {
+  const char *cut = strstr(FULL_BODY, "\"Soda\"");
+  clearSeen();
+  SheetsValuesParser parser(recordRow, nullptr);
+  size_t left = feed(parser, FULL_BODY, cut - FULL_BODY, 16);
+  TEST_ASSERT_FALSE(parser.failed());
+  TEST_ASSERT_NOT_EQUAL(0, left);
+  TEST_ASSERT_FALSE(parser.complete());
+}
+
+// Everything but the final "}": the last range closed but the document
+// did not
+static void test_missing_final_brace_is_incomplete() {
+  const char *cut = strrchr(FULL_BODY, '}');
+  SheetsValuesParser parser(recordRow, nullptr);
+  feed(parser, FULL_BODY, cut - FULL_BODY, 16);
+  TEST_ASSERT_FALSE(parser.failed());
+  TEST_ASSERT_FALSE(parser.complete());
+}
+
+// ===================== RUNNER ========================================
+
+void setup() {
+  delay(2000);   // Let the serial monitor attach
+  UNITY_BEGIN();
+  RUN_TEST(test_string_escapes_decode_in_place);
+  RUN_TEST(test_unicode_escapes_become_utf8);
+  RUN_TEST(test_bad_unicode_escape_is_replaced);
+  RUN_TEST(test_numbers_booleans_and_null);
+  RUN_TEST(test_empty_rows_keep_their_index);
+  RUN_TEST(test_brackets_and_commas_inside_strings);
+  RUN_TEST(test_extra_cells_are_dropped);
+  RUN_TEST(test_empty_range_keeps_range_numbering);
+  RUN_TEST(test_unbalanced_close_fails);
+  RUN_TEST(test_chunk_boundaries_do_not_change_rows);
+  RUN_TEST(test_toLong_is_decimal);
+  RUN_TEST(test_toAddress_accepts_decimal_and_hex);
+  RUN_TEST(test_full_body_is_complete);
+  RUN_TEST(test_truncated_between_rows_is_incomplete);
+  RUN_TEST(test_truncated_mid_row_is_incomplete);
+  RUN_TEST(test_missing_final_brace_is_incomplete);
+  UNITY_END();
+}
+
+void loop() {}